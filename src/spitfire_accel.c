@@ -5,6 +5,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sched.h>
 
 #include "xf86.h"
 #include "xf86_OSproc.h"
@@ -26,6 +27,14 @@
 #include "exa.h"
 #include <X11/Xarch.h>
 #include "miline.h"
+#include "gcstruct.h"
+#include "pixmapstr.h"
+#include "damage.h"
+#include "dixfontstr.h"
+#include "servermd.h"
+#ifdef RENDER
+#include "mipict.h"
+#endif
 
 #include "spitfire_driver.h"
 #include  "spitfire_accel.h"
@@ -49,27 +58,11 @@ SpitfireSetupForScreenToScreenCopy(
     int rop,
     unsigned planemask,
     int transparency_color);
-static void 
-SpitfireSubsequentScreenToScreenCopy(
-    ScrnInfoPtr pScrn,
-    int x1,
-    int y1,
-    int x2,
-    int y2,
-    int w,
-    int h);
-
 static void SpitfireSetupForSolidFill(
     ScrnInfoPtr pScrn,
     int color, 
     int rop,
     unsigned int planemask);
-static void SpitfireSubsequentSolidFillRect(
-    ScrnInfoPtr pScrn,
-    int x,
-    int y,
-    int w,
-    int h);
 static void SpitfireSetupForMono8x8PatternFill(
 	ScrnInfoPtr pScrn,
 	int patx, int paty,
@@ -82,8 +75,76 @@ static void SpitfireSubsequentMono8x8PatternFillRect(
 	int patx, int paty,
 	int x, int y, int w, int h
    );
+static void SpitfireSetupForMono8x8PatternTile(
+    ScrnInfoPtr pScrn,
+    int patx, int paty,
+    int fg, int bg,
+    int rop,
+    unsigned int planemask);
+static void SpitfireSubsequentMono8x8PatternTileRect(
+    ScrnInfoPtr pScrn,
+    int patx, int paty,
+    int x, int y, int w, int h);
+static void SpitfireSetupForColor8x8PatternFill(
+    ScrnInfoPtr pScrn,
+    int patx, int paty,
+    int rop,
+    unsigned int planemask,
+    int trans_color);
+static void SpitfireSubsequentColor8x8PatternFillRect(
+    ScrnInfoPtr pScrn,
+    int patx, int paty,
+    int x, int y, int w, int h);
+static void SpitfireSetupForSolidLine(
+    ScrnInfoPtr pScrn,
+    int color,
+    int rop,
+    unsigned int planemask);
+static void SpitfireSubsequentSolidHorVertLine(
+    ScrnInfoPtr pScrn,
+    int x, int y, int len, int dir);
+static void SpitfireSubsequentSolidBresenhamLine(
+    ScrnInfoPtr pScrn,
+    int x, int y, int absmaj, int absmin, int err, int len, int octant);
+static void SpitfireSubsequentSolidTwoPointLine(
+    ScrnInfoPtr pScrn,
+    int x1, int y1, int x2, int y2, int flags);
+static void SpitfireSetupForScanlineCPUToScreenColorExpandFill(
+    ScrnInfoPtr pScrn,
+    int fg, int bg,
+    int rop,
+    unsigned int planemask);
+static void SpitfireSubsequentScanlineCPUToScreenColorExpandFill(
+    ScrnInfoPtr pScrn,
+    int x, int y, int w, int h,
+    int skipleft);
+static void SpitfireSubsequentColorExpandScanline(
+    ScrnInfoPtr pScrn,
+    int bufno);
+static void SpitfireSetClippingRectangle(
+    ScrnInfoPtr pScrn,
+    int left, int top,
+    int right, int bottom);
+static void SpitfireDisableClipping(
+    ScrnInfoPtr pScrn);
+static Bool SpitfireProbeMaskBoundary(
+    SpitfirePtr pdrv,
+    CARD32 offset);
+static void SpitfireXAAInstallBppFuncs(XAAInfoRecPtr xaaptr, int bpp);
 #endif
 
+/* Engine pixel format and pitch-to-width shift, indexed by bitsPerPixel / 8.
+   24bpp is programmed as 8bpp, so its width is the pitch in bytes. Pixmaps
+   below 8bpp are never handed to the engine, so the first entry is unused. */
+static const CARD8 SpitfireBppFormat[5] = {
+    0,
+    SPITFIRE_FORMAT_8BPP,
+    SPITFIRE_FORMAT_16BPP,
+    SPITFIRE_FORMAT_8BPP,
+    SPITFIRE_FORMAT_32BPP
+};
+static const CARD8 SpitfireBppShift[5] = { 0, 0, 1, 0, 2 };
+
 Bool SpitfireInitAccel(ScreenPtr pScreen)
 {
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
@@ -95,6 +156,27 @@ Bool SpitfireInitAccel(ScreenPtr pScreen)
     pdrv->cxMemory = pdrv->lDelta / (pdrv->Bpp);
     pdrv->cyMemory = pdrv->endfb / pdrv->lDelta - 1;
 
+    pdrv->ScrnIndex = pScrn->scrnIndex;
+    pdrv->LastCmd = 0;
+    pdrv->EngineHangs = 0;
+    pdrv->HangSeq = pdrv->SubmitSeq;
+    pdrv->EngineFailed = FALSE;
+    pdrv->PendingPixels = 0;
+    memset(pdrv->WaitHist, 0, sizeof(pdrv->WaitHist));
+
+    /* Framebuffer as seen by the engine, used by all XAA operations. At 24bpp
+       it is programmed at 8bpp, or at 16bpp when its pitch does not fit the
+       width of an 8bpp pixmap. */
+    pdrv->Accel.FbFormat = SpitfireBppFormat[pdrv->Bpp];
+    pdrv->Accel.FbWidth = pdrv->cxMemory * ((pdrv->Bpp == 3) ? 3 : 1) - 1;
+    pdrv->Accel.FbLines = pdrv->cyMemory;
+    pdrv->Accel.XScale = 1;
+    pdrv->Accel.Wide = (pdrv->Bpp == 3 && pdrv->lDelta > 0xFFF);
+    if (pdrv->Accel.Wide) {
+        pdrv->Accel.FbFormat = SPITFIRE_FORMAT_16BPP;
+        pdrv->Accel.FbWidth = pdrv->lDelta / 2 - 1;
+    }
+
     if (pdrv->useEXA)
         return SpitfireEXAInit(pScreen);
     else
@@ -119,11 +201,14 @@ Bool SpitfireXAAInit(ScreenPtr pScreen)
 
     /* The 64111 supports ROPs with pixmaps of 1, 8, 16, 32 bits per pixel, BUT
        NOT with 24 bits per pixel. So throughout the code that uses 24-bit 
-       pixmaps will only program the GE at 8 bits per pixel. This only works 
-       with pitches less than 4096 bytes. Operations that could possibly mix 
-       24-bit with 1-bit patterns are out of luck - they cannot be accelerated.
+       pixmaps will only program the GE at 8 bits per pixel. With pitches of
+       4096 bytes or more, it is programmed at 16 bits per pixel instead, up
+       to the widest 16bpp pixmap and as long as the pitch is DWORD aligned.
+       Operations that could possibly mix 24-bit with 1-bit patterns are out
+       of luck - they cannot be accelerated.
      */
-    pixmapsSupported = (pScrn->bitsPerPixel != 24 || pdrv->Bpl < 4096);
+    pixmapsSupported = (pScrn->bitsPerPixel != 24 || !pdrv->Accel.Wide
+        || (pdrv->lDelta <= 0x2000 && !(pdrv->lDelta & 3)));
 
     xaaptr->Flags = 0
         | PIXMAP_CACHE
@@ -134,47 +219,169 @@ Bool SpitfireXAAInit(ScreenPtr pScreen)
     /* Sync with graphics engine */
     xaaptr->Sync = SpitfireAccelSync;
 
-    /* Clipping */
+    /* Clipping, with the mask map as a scissor (see SpitfireXAAScissor). Not
+       in 24 bpp, where fills are split up or done by the CPU. The probe
+       scribbles on the last line of offscreen memory, before any of it is
+       handed out. */
+    if (pScrn->bitsPerPixel != 24 && pdrv->cyMemory - 1 > pScrn->virtualY
+        && pdrv->lDelta >= 64 + 256
+        && SpitfireProbeMaskBoundary(pdrv, (pdrv->cyMemory - 1) * pdrv->lDelta)) {
+        xaaptr->ClippingFlags = 0
+            | HARDWARE_CLIP_SOLID_LINE
+            | HARDWARE_CLIP_SOLID_FILL
+            | HARDWARE_CLIP_MONO_8x8_FILL
+            | HARDWARE_CLIP_COLOR_8x8_FILL
+            ;
+        xaaptr->SetClippingRectangle = SpitfireSetClippingRectangle;
+        xaaptr->DisableClipping = SpitfireDisableClipping;
+        pdrv->Accel.Clip = FALSE;
+    }
 
     /* ScreenToScreen copies */
     if (pixmapsSupported) {
-        xaaptr->ScreenToScreenCopyFlags = 0
-            | NO_PLANEMASK;
+        xaaptr->ScreenToScreenCopyFlags = 0;
 
         /* No way to define full color keying with 24-bit pixmaps, RGB_EQUAL 
-           does not apply to this operation. */
+           does not apply to this operation. The compare is done per byte, so
+           a pixel sharing some of its bytes with the key would only be partly
+           written. The planemask would also apply to each byte. */
         if (pScrn->bitsPerPixel == 24)
-            xaaptr->ScreenToScreenCopyFlags |= NO_TRANSPARENCY;
+            xaaptr->ScreenToScreenCopyFlags |= NO_TRANSPARENCY | NO_PLANEMASK;
 
         xaaptr->SetupForScreenToScreenCopy = SpitfireSetupForScreenToScreenCopy;
-        xaaptr->SubsequentScreenToScreenCopy = SpitfireSubsequentScreenToScreenCopy;
     }
 
     /* Solid filled rectangles */
     if (pixmapsSupported) {
-        xaaptr->SolidFillFlags = 0
-            | NO_PLANEMASK;
-
-        /* 24-bit mode treated as 8-bit, only supports grayscale filling  */
-        if (pScrn->bitsPerPixel == 24) xaaptr->SolidFillFlags |= RGB_EQUAL;
+        xaaptr->SolidFillFlags = 0;
+        if (pScrn->bitsPerPixel == 24)
+            xaaptr->SolidFillFlags |= NO_PLANEMASK;
+
+        /* 24-bit mode treated as 8-bit, only supports grayscale filling,
+           unless there is a line to spare for the seed row of full color
+           fills */
+        if (pScrn->bitsPerPixel == 24) {
+            if (pdrv->cyMemory - 1 > pScrn->virtualY) {
+                pdrv->cyMemory--;
+                pdrv->SeedLine = pdrv->cyMemory;
+                pdrv->SeedBytes = min(pdrv->lDelta, SPITFIRE_SEED_BYTES);
+                pdrv->SeedValid = FALSE;
+            } else
+                xaaptr->SolidFillFlags |= RGB_EQUAL;
+        }
 
         xaaptr->SetupForSolidFill = SpitfireSetupForSolidFill;
-        xaaptr->SubsequentSolidFillRect = SpitfireSubsequentSolidFillRect;
     }
+    SpitfireXAAInstallBppFuncs(xaaptr, pScrn->bitsPerPixel);
 
-    /* Solid lines */
-
+    /* Solid lines, not in 24 bpp where the engine would step over bytes 
+       instead of pixels. Lines within the 12-bit coordinate space keep their
+       Bresenham terms within 14 bits. Lines that are clipped by the engine
+       may start off the screen, XAA first clips those to video memory. */
+    if (pScrn->bitsPerPixel != 24) {
+        xaaptr->SolidLineFlags = 0
+            | LINE_LIMIT_COORDS;
+        xaaptr->SolidLineLimits.x1 = 0;
+        xaaptr->SolidLineLimits.y1 = 0;
+        xaaptr->SolidLineLimits.x2 = min(pdrv->cxMemory, 0x1000) - 1;
+        xaaptr->SolidLineLimits.y2 = pdrv->Accel.FbLines - 1;
+        xaaptr->SolidBresenhamLineErrorTermBits = 14;
+        xaaptr->SetupForSolidLine = SpitfireSetupForSolidLine;
+        xaaptr->SubsequentSolidHorVertLine = SpitfireSubsequentSolidHorVertLine;
+        xaaptr->SubsequentSolidBresenhamLine = SpitfireSubsequentSolidBresenhamLine;
+        xaaptr->SubsequentSolidTwoPointLine = SpitfireSubsequentSolidTwoPointLine;
+    }
 
-    /* Mono 8x8 pattern fills, cannot be accelerated in 24 bpp */
+    /* Mono 8x8 pattern fills. In 24 bpp, the engine cannot expand the pattern
+       itself, so the CPU expands it into color tiles at the end of video 
+       memory, which are copied from. Not at 16bpp pitches, where the tiles
+       would need both byte parities. */
     if (pScrn->bitsPerPixel != 24) {
         xaaptr->Mono8x8PatternFillFlags = 0
-            | NO_PLANEMASK
             | BIT_ORDER_IN_BYTE_LSBFIRST
             | HARDWARE_PATTERN_PROGRAMMED_ORIGIN
             ;
         xaaptr->SetupForMono8x8PatternFill = SpitfireSetupForMono8x8PatternFill;
         xaaptr->SubsequentMono8x8PatternFillRect = SpitfireSubsequentMono8x8PatternFillRect;
+    } else if (pixmapsSupported && !pdrv->Accel.Wide) {
+        int lines = (SPITFIRE_MONO_TILES * SPITFIRE_MONO_TILE_PITCH
+                     * SPITFIRE_MONO_TILE_LINES * 2 + 3) / pdrv->lDelta + 1;
+
+        if (pdrv->cyMemory - lines > pScrn->virtualY) {
+            int i;
+
+            pdrv->cyMemory -= lines;
+            pdrv->MonoTileOffset = (pdrv->cyMemory * pdrv->lDelta + 3) & ~3;
+            for (i = 0; i < SPITFIRE_MONO_TILES; i++)
+                pdrv->MonoTiles[i].valid = FALSE;
+            pdrv->MonoTileUses = 0;
+
+            xaaptr->Mono8x8PatternFillFlags = 0
+                | NO_PLANEMASK
+                | BIT_ORDER_IN_BYTE_LSBFIRST
+                | HARDWARE_PATTERN_PROGRAMMED_BITS
+                | HARDWARE_PATTERN_PROGRAMMED_ORIGIN
+                | TRANSPARENCY_GXCOPY_ONLY
+                ;
+            xaaptr->SetupForMono8x8PatternFill = SpitfireSetupForMono8x8PatternTile;
+            xaaptr->SubsequentMono8x8PatternFillRect = SpitfireSubsequentMono8x8PatternTileRect;
+        }
+    }
+
+    /* Color 8x8 pattern fills. XAA keeps the pattern in the pixmap cache as
+       8 lines of 8 pixels, the engine wants it packed, so it is first copied
+       into a scratch area at the end of video memory. Not in 24 bpp, where
+       the engine would tile the pattern by bytes. */
+    if (pScrn->bitsPerPixel != 24) {
+        int lines = (8 * 8 * pdrv->Bpp + pdrv->lDelta - 1) / pdrv->lDelta;
+
+        if (pdrv->cyMemory - lines > pScrn->virtualY) {
+            pdrv->cyMemory -= lines;
+            pdrv->PatternOffset = pdrv->cyMemory * pdrv->lDelta;
+
+            xaaptr->Color8x8PatternFillFlags = 0
+                | HARDWARE_PATTERN_PROGRAMMED_ORIGIN
+                ;
+            xaaptr->SetupForColor8x8PatternFill = SpitfireSetupForColor8x8PatternFill;
+            xaaptr->SubsequentColor8x8PatternFillRect = SpitfireSubsequentColor8x8PatternFillRect;
+        }
+    }
+
+    /* CPU to screen color expansion, mostly text. The engine cannot take 
+       data from the CPU, so XAA writes each scanline into one of a few 
+       buffers at the end of video memory, which the engine expands from.
+       Cannot be accelerated in 24 bpp. */
+    if (pScrn->bitsPerPixel != 24
+        && pdrv->cxMemory + 31 < SPITFIRE_SCANLINE_PITCH * 8) {
+        int lines = (SPITFIRE_SCANLINE_BUFFERS * SPITFIRE_SCANLINE_PITCH
+                     + pdrv->lDelta - 1) / pdrv->lDelta;
+
+        if (pdrv->cyMemory - lines > pScrn->virtualY) {
+            int i;
+
+            pdrv->cyMemory -= lines;
+            pdrv->ScanlineOffset = pdrv->cyMemory * pdrv->lDelta;
+            for (i = 0; i < SPITFIRE_SCANLINE_BUFFERS; i++) {
+                pdrv->ScanlineBuffers[i] = pdrv->FBBase + pdrv->ScanlineOffset
+                    + i * SPITFIRE_SCANLINE_PITCH;
+                pdrv->ScanlineSeq[i] = pdrv->SubmitSeq;
+            }
+
+            xaaptr->ScanlineCPUToScreenColorExpandFillFlags = 0
+                | BIT_ORDER_IN_BYTE_LSBFIRST
+                | LEFT_EDGE_CLIPPING
+                ;
+            xaaptr->NumScanlineColorExpandBuffers = SPITFIRE_SCANLINE_BUFFERS;
+            xaaptr->ScanlineColorExpandBuffers = pdrv->ScanlineBuffers;
+            xaaptr->SetupForScanlineCPUToScreenColorExpandFill =
+                SpitfireSetupForScanlineCPUToScreenColorExpandFill;
+            xaaptr->SubsequentScanlineCPUToScreenColorExpandFill =
+                SpitfireSubsequentScanlineCPUToScreenColorExpandFill;
+            xaaptr->SubsequentColorExpandScanline =
+                SpitfireSubsequentColorExpandScanline;
+        }
     }
+
     /* ImageWrite */
 
     /* Set up screen parameters. */
@@ -200,623 +407,4617 @@ Bool SpitfireXAAInit(ScreenPtr pScreen)
 #endif
 }
 
-#define MAXLOOP			0xffffff
-void SpitfireAccelSync(ScrnInfoPtr pScrn)
+/* Time after which a busy engine is taken to be hung */
+#define SPITFIRE_HANG_USEC	3000000
+/* Status reads allowed for a terminated command to stop */
+#define SPITFIRE_TERMINATE_LOOP	0xfffff
+/* Hangs after which the engine is no longer used */
+#define SPITFIRE_MAX_HANGS	3
+/* Commands retired after a hang before it no longer counts towards those */
+#define SPITFIRE_HANG_FORGET	100000
+
+/* Waiting for the engine. Every status read is an uncached PCI transaction,
+   which competes with the engine for the bus, so after a few back-to-back
+   reads the status is only polled every so often, with the CPU idling in 
+   between. The interval follows the time the engine is expected to need for
+   the pixels it was given, and past SPITFIRE_YIELD_USEC the CPU is given 
+   away between polls. The engine throughput is a rough figure, it only needs
+   to be in the right order of magnitude. */
+#define SPITFIRE_SPIN_READS	16
+#define SPITFIRE_POLL_MAX_USEC	100
+#define SPITFIRE_YIELD_USEC	1000
+#define SPITFIRE_ENGINE_BYTES_PER_USEC	40
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define SPITFIRE_CPU_PAUSE()	__builtin_ia32_pause()
+#else
+#define SPITFIRE_CPU_PAUSE()	do { } while (0)
+#endif
+
+/* Kinds of commands that wait times are kept apart for, by opcode */
+#define SPITFIRE_WAIT_LINE	0
+#define SPITFIRE_WAIT_BLIT	1
+#define SPITFIRE_WAIT_FILL	2
+#define SPITFIRE_WAIT_TEXT	3
+#define SPITFIRE_WAIT_PATTERN	4
+
+static const CARD8 SpitfireWaitType[16] = {
+    SPITFIRE_WAIT_BLIT, SPITFIRE_WAIT_BLIT,
+    SPITFIRE_WAIT_LINE, SPITFIRE_WAIT_LINE,     /* Short strokes, lines */
+    SPITFIRE_WAIT_LINE, SPITFIRE_WAIT_LINE,
+    SPITFIRE_WAIT_BLIT, SPITFIRE_WAIT_BLIT,
+    SPITFIRE_WAIT_BLIT, SPITFIRE_WAIT_BLIT,     /* Bitblt, inverted bitblt */
+    SPITFIRE_WAIT_FILL, SPITFIRE_WAIT_TEXT,
+    SPITFIRE_WAIT_PATTERN, SPITFIRE_WAIT_BLIT,
+    SPITFIRE_WAIT_BLIT, SPITFIRE_WAIT_BLIT
+};
+
+static const char *SpitfireWaitTypeName[SPITFIRE_WAIT_TYPES] = {
+    "lines", "blits", "fills", "color expansions", "pattern fills"
+};
+
+static void SpitfireEngineHang(SpitfirePtr pdrv);
+
+static inline Bool
+SpitfireEngineBusy(SpitfirePtr pdrv)
 {
-    SpitfirePtr pdrv = DEVPTR(pScrn);
-    unsigned int loop = 0;
-    
-    /* Wait for BUSY bit to change to zero */
-    while ((MMIO_IN8(SPITFIRE_MMIO, SPITFIRE_CP_STATUS) & SPITFIRE_CP_BUSY) && (loop++ < MAXLOOP));
+    return (MMIO_IN8(SPITFIRE_MMIO, SPITFIRE_CP_STATUS) & SPITFIRE_CP_BUSY) != 0;
 }
 
-/* Helper function to program a video address, width and height of a on-screen pixmap */
-static void
-SpitfireSetupPixMap(
-    SpitfirePtr pdrv,
-    unsigned int pixIndex,
-    CARD32 pixAddr,
-    CARD16 pixWidth,
-    CARD16 pixHeight,
-    CARD8 pixFormat)
+/* Microseconds the engine should need for what it has been given */
+static CARD64
+SpitfireExpectedWait(SpitfirePtr pdrv)
 {
-    /* Select which of the 4 pixmaps is being defined */
-    MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_PIXMAP_SELECT, pixIndex);
+    /* 24bpp is programmed at 8 or 16bpp, with the width scaled to match */
+    int bytes = (pdrv->Bpp == 3) ? (pdrv->Accel.Wide ? 2 : 1) : pdrv->Bpp;
 
-    /* Location of this pixmap */
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_PIXMAP_BASE, pixAddr);
-
-    /* Program dimensions of the pixmap */
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_PIXMAP_WIDTH,  pixWidth);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_PIXMAP_HEIGHT, pixHeight);
-    
-    /* Program pixel format. All pixmaps are assumed to be in framebuffer, not in system memory. */
-    MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_PIXMAP_FORMAT, pixFormat | SPITFIRE_FORMAT_VIDEOMEM);
+    return pdrv->PendingPixels * bytes / SPITFIRE_ENGINE_BYTES_PER_USEC;
 }
 
-#ifdef HAVE_XAA_H
-static void 
-SpitfireSetupForScreenToScreenCopy(
-    ScrnInfoPtr pScrn,
-    int xdir, 
-    int ydir,
-    int rop,
-    unsigned planemask, /* <-- not supported */
-    int transparency_color)
+/* Count a wait of usec microseconds, or one that found the engine idle if
+   usec is negative, against the kind of command submitted last */
+static void
+SpitfireRecordWait(SpitfirePtr pdrv, INT64 usec)
 {
-    SpitfirePtr pdrv = DEVPTR(pScrn);
-    unsigned int cmd;
-
-    cmd = SPITFIRE_CMD_BITBLT
-        | SPITFIRE_SRC_PIXMAP_A
-        | SPITFIRE_PAT_FOREGROUND
-        | SPITFIRE_DST_PIXMAP_C
-        | SPITFIRE_FORE_SRC_PIXMAP
-        | SPITFIRE_BACK_SRC_PIXMAP;
-    if (xdir == -1) cmd |= SPITFIRE_DEC_X;
-    if (ydir == -1) cmd |= SPITFIRE_DEC_Y;
-
-    /* Need to wait for previous accel operation to finish, otherwise
-     * output gets scrambled. */
-    SpitfireAccelSync(pScrn);
-
-    if (transparency_color != -1) {
-        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COLOR, transparency_color);
-        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COND, 2); /* Update on != transparency_color */
-    } else {
-        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COLOR, 0);
-        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COND, 6); /* Always update */
-    }
-    MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_ROPMIX, XAAGetCopyROP(rop));
-    
-    /* Set up source and destination pixmaps to the entire framebuffer */
-    if (pScrn->bitsPerPixel != 24) {
-        CARD8 pixFormat = 0;
-
-        switch (pScrn->bitsPerPixel) {
-        case 8:  pixFormat = SPITFIRE_FORMAT_8BPP;  break;
-        case 16: pixFormat = SPITFIRE_FORMAT_16BPP; break;
-        case 32: pixFormat = SPITFIRE_FORMAT_32BPP; break;
-        }
-        SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_A, 
-            0, pdrv->cxMemory - 1, pdrv->cyMemory - 1, 
-            pixFormat);
-        SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_C, 
-            0, pdrv->cxMemory - 1, pdrv->cyMemory - 1, 
-            pixFormat);
-    } else {
-        SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_A, 
-            0, pdrv->cxMemory * 3 - 1, pdrv->cyMemory - 1, 
-            SPITFIRE_FORMAT_8BPP);
-        SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_C, 
-            0, pdrv->cxMemory * 3 - 1, pdrv->cyMemory - 1, 
-            SPITFIRE_FORMAT_8BPP);
+    SpitfireWaitHistPtr hist = 
+        &pdrv->WaitHist[SpitfireWaitType[(pdrv->LastCmd & SPITFIRE_CMD_OPCODE_MASK) >> 24]];
+    int bucket = 0;
+
+    if (usec >= 0) {
+        hist->TotalUsec += usec;
+        for (bucket = 1; bucket < SPITFIRE_WAIT_BUCKETS - 1
+                         && usec >= (1LL << (bucket - 1)); bucket++)
+            ;
     }
-    
-    pdrv->SavedAccelCmd = cmd;
+    hist->Count[bucket]++;
 }
 
-static void 
-SpitfireSubsequentScreenToScreenCopy(
-    ScrnInfoPtr pScrn,
-    int x1,
-    int y1,
-    int x2,
-    int y2,
-    int w,
-    int h)
+/* Everything submitted so far has been executed. Hangs the engine has come
+   through are forgotten once it has gone on to retire SPITFIRE_HANG_FORGET
+   more commands, so that only hangs in close succession give up on it. */
+static inline void
+SpitfireRetireAll(SpitfirePtr pdrv)
 {
-    SpitfirePtr pdrv = DEVPTR(pScrn);
-
-    /* On 24bpp, we are pretending to work at 8bpp, so triple all dimensions */
-    if (pScrn->bitsPerPixel == 24) {
-        x1 *= 3; x2 *= 3; w *= 3;
-    }
-
-    /* Need to wait for previous accel operation to finish, otherwise
-     * output gets scrambled. */
-    SpitfireAccelSync(pScrn);
-
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OP_DIM_1, w - 1);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OP_DIM_2, h - 1);
+    pdrv->CmdPending = 0;
+    pdrv->PendingPixels = 0;
+    pdrv->RetiredSeq = pdrv->SubmitSeq;
+    if (pdrv->EngineHangs
+        && pdrv->SubmitSeq - pdrv->HangSeq >= SPITFIRE_HANG_FORGET)
+        pdrv->EngineHangs = 0;
+}
 
-    /* When specifying SPITFIRE_DEC_[XY], we need to specify the rightmost or
-     * bottommost pixel coordinate, as required. */
-    if (pdrv->SavedAccelCmd & SPITFIRE_DEC_X) {
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_SRC, x1 + w - 1);
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_DST, x2 + w - 1);
-    } else {
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_SRC, x1);
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_DST, x2);
-    }
-    if (pdrv->SavedAccelCmd & SPITFIRE_DEC_Y) {
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_SRC, y1 + h - 1);
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_DST, y2 + h - 1);
+/* Wait until the engine has executed everything it was given. An engine that
+   stays busy for SPITFIRE_HANG_USEC is taken to be hung. Once it has been
+   given up on, there is nothing to wait for. */
+static void SpitfireWaitIdle(SpitfirePtr pdrv)
+{
+    CARD64 start, now, expected, interval, elapsed;
+    int spins = 0;
+
+    if (pdrv->EngineFailed) {
+        /* Nothing to wait for */
+    } else if (!SpitfireEngineBusy(pdrv)) {
+        if (pdrv->CmdPending)
+            SpitfireRecordWait(pdrv, -1);
     } else {
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_SRC, y1);
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_DST, y2);
+        start = GetTimeInMicros();
+        expected = SpitfireExpectedWait(pdrv);
+
+        /* Short operations are done by the time a few reads have gone out */
+        while (SpitfireEngineBusy(pdrv)) {
+            if (++spins < SPITFIRE_SPIN_READS)
+                continue;
+
+            now = GetTimeInMicros();
+            elapsed = now - start;
+            if (elapsed > SPITFIRE_HANG_USEC) {
+                SpitfireEngineHang(pdrv);
+                break;
+            }
+
+            /* Poll at half the time still expected, or more and more rarely
+               once the engine is late */
+            if (elapsed < expected)
+                interval = (expected - elapsed) / 2;
+            else
+                interval = elapsed / 8;
+            interval = max(1, min(interval, SPITFIRE_POLL_MAX_USEC));
+
+            if (elapsed >= SPITFIRE_YIELD_USEC
+                || (elapsed < expected && expected - elapsed >= SPITFIRE_YIELD_USEC))
+                sched_yield();
+            while (GetTimeInMicros() < now + interval)
+                SPITFIRE_CPU_PAUSE();
+        }
+        SpitfireRecordWait(pdrv, GetTimeInMicros() - start);
     }
 
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_COMMAND, pdrv->SavedAccelCmd);
+    SpitfireRetireAll(pdrv);
 }
 
-static void SpitfireSetupForSolidFill(
-    ScrnInfoPtr pScrn,
-    int color, 
-    int rop,
-    unsigned int planemask)
+/* Check once, without waiting, whether the engine has drained. */
+static Bool SpitfireEngineIdle(SpitfirePtr pdrv)
 {
-    SpitfirePtr pdrv = DEVPTR(pScrn);
-    unsigned int cmd;
-
-    cmd = SPITFIRE_CMD_FILL
-        | SPITFIRE_PAT_FOREGROUND
-        | SPITFIRE_DST_PIXMAP_C
-        | SPITFIRE_FORE_SRC_FGCOLOR /* <-- Use foreground color, not pixmap, as source */
-        | SPITFIRE_BACK_SRC_BGCOLOR;/* <-- Use background color, not pixmap, as source */
-
-    /* Need to wait for previous accel operation to finish, otherwise
-     * output gets scrambled. */
-    SpitfireAccelSync(pScrn);
+    if (!pdrv->EngineFailed && SpitfireEngineBusy(pdrv))
+        return FALSE;
 
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_FGCOLOR, color);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_BGCOLOR, color);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COLOR, 0);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COND, 6); /* Always update */
-    MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_ROPMIX, XAAGetCopyROP(rop));
+    SpitfireRetireAll(pdrv);
+    return TRUE;
+}
 
-    /* Set up source and destination pixmaps to the entire framebuffer */
-    if (pScrn->bitsPerPixel != 24) {
-        CARD8 pixFormat = 0;
+void SpitfireAccelSync(ScrnInfoPtr pScrn)
+{
+    SpitfireWaitIdle(DEVPTR(pScrn));
+}
 
-        switch (pScrn->bitsPerPixel) {
-        case 8:  pixFormat = SPITFIRE_FORMAT_8BPP;  break;
-        case 16: pixFormat = SPITFIRE_FORMAT_16BPP; break;
-        case 32: pixFormat = SPITFIRE_FORMAT_32BPP; break;
+/* Log the engine wait times recorded so far, one histogram per kind of 
+   command, for Option "DumpWaitStats" */
+void SpitfireDumpWaitStats(ScrnInfoPtr pScrn)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    char line[SPITFIRE_WAIT_BUCKETS * 24];
+    int type, i, len;
+
+    for (type = 0; type < SPITFIRE_WAIT_TYPES; type++) {
+        SpitfireWaitHistPtr hist = &pdrv->WaitHist[type];
+        CARD64 count = 0;
+
+        for (i = 0; i < SPITFIRE_WAIT_BUCKETS; i++)
+            count += hist->Count[i];
+        if (!count)
+            continue;
+
+        len = snprintf(line, sizeof(line), "idle:%u", (unsigned)hist->Count[0]);
+        for (i = 1; i < SPITFIRE_WAIT_BUCKETS; i++) {
+            if (!hist->Count[i])
+                continue;
+            if (i < SPITFIRE_WAIT_BUCKETS - 1)
+                len += snprintf(line + len, sizeof(line) - len, " <%lluus:%u",
+                                1ULL << (i - 1), (unsigned)hist->Count[i]);
+            else
+                len += snprintf(line + len, sizeof(line) - len, " more:%u",
+                                (unsigned)hist->Count[i]);
         }
-        SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_C, 
-            0, pdrv->cxMemory - 1, pdrv->cyMemory - 1, 
-            pixFormat);
-    } else {
-        SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_C, 
-            0, pdrv->cxMemory * 3 - 1, pdrv->cyMemory - 1, 
-            SPITFIRE_FORMAT_8BPP);
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "Engine waits after %s: %llu, %llu us in total\n",
+                   SpitfireWaitTypeName[type], (unsigned long long)count,
+                   (unsigned long long)hist->TotalUsec);
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "  %s\n", line);
     }
-    
-    pdrv->SavedAccelCmd = cmd;
 }
 
-static void SpitfireSubsequentSolidFillRect(
-    ScrnInfoPtr pScrn,
-    int x,
-    int y,
-    int w,
-    int h)
+/* Submissions are numbered by a wrapping 32-bit counter */
+static Bool SpitfireSeqRetired(SpitfirePtr pdrv, CARD32 seq)
 {
-    SpitfirePtr pdrv = DEVPTR(pScrn);
-
-    /* On 24bpp, we are pretending to work at 8bpp, so triple all dimensions */
-    if (pScrn->bitsPerPixel == 24) {
-        x *= 3; w *= 3;
-    }
+    return (INT32)(pdrv->RetiredSeq - seq) >= 0;
+}
 
-    /* Need to wait for previous accel operation to finish, otherwise
-     * output gets scrambled. */
-    SpitfireAccelSync(pScrn);
+/* Wait until the engine is done with the given submission. The engine cannot
+   report progress through its command buffer, so this means waiting for it
+   to become idle unless the submission is already known to be retired. */
+static void SpitfireWaitSeq(SpitfirePtr pdrv, CARD32 seq)
+{
+    if (SpitfireSeqRetired(pdrv, seq) || SpitfireEngineIdle(pdrv))
+        return;
+    SpitfireWaitIdle(pdrv);
+}
 
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OP_DIM_1, w - 1);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OP_DIM_2, h - 1);
+/* Make room in the coprocessor command buffer for one more command. The only 
+   state the engine reports is whether it is busy, so the number of commands
+   in flight is counted here and the engine is only waited upon once that 
+   count reaches the configured depth of the buffer. */
+static void SpitfireWaitCmdSlot(SpitfirePtr pdrv)
+{
+    if (pdrv->CmdPending < pdrv->CmdBufferDepth)
+        return;
 
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_SRC, x);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_DST, x);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_SRC, y);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_DST, y);
+    /* A single status read is enough if the buffer has drained meanwhile */
+    if (SpitfireEngineIdle(pdrv))
+        return;
+    SpitfireWaitIdle(pdrv);
+}
 
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_COMMAND, pdrv->SavedAccelCmd);
+/* Submit a command whose parameters have already been written. Nothing is
+   started on an engine that has been given up on, XAA then draws with the
+   CPU (see SpitfireCpuSetup) and EXA leaves everything to fb. */
+static void SpitfireKickCmd(SpitfirePtr pdrv, CARD32 cmd)
+{
+    if (!pdrv->EngineFailed)
+        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_COMMAND, cmd);
+    pdrv->LastCmd = cmd;
+    pdrv->CmdPending++;
+    pdrv->SubmitSeq++;
 }
 
-static void SpitfireSetupForMono8x8PatternFill(
-	ScrnInfoPtr pScrn,
-	int patx, int paty,
-	int fg, int bg,
-	int rop,
-	unsigned int planemask)
+/* Submit a word of short-stroke vectors, drawn with the command already 
+   written to SPITFIRE_COMMAND */
+static void SpitfireKickStrokes(SpitfirePtr pdrv, CARD32 strokes)
 {
-    SpitfirePtr pdrv = DEVPTR(pScrn);
-    CARD8 pixFormat = 0;
-    unsigned int cmd;
-    CARD32 patoffset;
+    if (!pdrv->EngineFailed)
+        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_SHORT_STROKE, strokes);
+    pdrv->CmdPending++;
+    pdrv->SubmitSeq++;
+}
 
-    cmd = SPITFIRE_CMD_BITBLT
-        | SPITFIRE_SRC_PIXMAP_A
-        | SPITFIRE_PAT_PIXMAP_B
-        | SPITFIRE_DST_PIXMAP_C
-        | SPITFIRE_FORE_SRC_FGCOLOR /* <-- Use foreground color, not pixmap, as source */
-        | ((bg != -1) 
-            ? SPITFIRE_BACK_SRC_BGCOLOR /* <-- Use background color, not pixmap, as source */
-            : SPITFIRE_BACK_SRC_PIXMAP) /* <-- Use source pixmap, so should be a noop */
-        ;
+/* Write a pair of adjacent 16-bit registers, the first one at reg. Unless 
+   disabled with Option "PackedMMIO", both go out as a single 32-bit write,
+   which halves the number of bus transactions needed per command. */
+static inline void
+SpitfireWriteRegPair(SpitfirePtr pdrv, int reg, CARD16 lo, CARD16 hi)
+{
+    /* Keep count of the work given to the engine, see SpitfireWaitIdle */
+    if (reg == SPITFIRE_OP_DIM_1)
+        pdrv->PendingPixels += (CARD32)(lo + 1) * (hi + 1);
+    if (pdrv->PackedMMIO) {
+        MMIO_OUT32(SPITFIRE_MMIO, reg, (CARD32)lo | ((CARD32)hi << 16));
+    } else {
+        MMIO_OUT16(SPITFIRE_MMIO, reg, lo);
+        MMIO_OUT16(SPITFIRE_MMIO, reg + 2, hi);
+    }
+}
 
-    /* Need to wait for previous accel operation to finish, otherwise
-     * output gets scrambled. */
-    SpitfireAccelSync(pScrn);
-
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_FGCOLOR, fg);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_BGCOLOR, bg);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COLOR, 0);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COND, 6); /* Always update */
-    MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_ROPMIX, XAAGetCopyROP(rop));
-
-    /* Set up destination pixmap to the entire framebuffer */
-    switch (pScrn->bitsPerPixel) {
-    case 8:  pixFormat = SPITFIRE_FORMAT_8BPP;  break;
-    case 16: pixFormat = SPITFIRE_FORMAT_16BPP; break;
-    case 32: pixFormat = SPITFIRE_FORMAT_32BPP; break;
-    }
-    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_A, 
-        0, pdrv->cxMemory - 1, pdrv->cyMemory - 1, 
-        pixFormat);
-    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_C, 
-        0, pdrv->cxMemory - 1, pdrv->cyMemory - 1, 
-        pixFormat);
+/* Pixmap, color and ROP registers are shared by all commands in the buffer, so
+   the engine must drain before any of them is changed. Otherwise, output gets
+   scrambled. */
+static void SpitfireStateBarrier(SpitfirePtr pdrv)
+{
+    if (pdrv->CmdPending)
+        SpitfireWaitIdle(pdrv);
+}
 
-    /* Set up pattern pixmap */
+/* Validity bits for the fields of SpitfireEngineStateRec */
+#define SPITFIRE_STATE_PIXSELECT    0x0001
+#define SPITFIRE_STATE_PIXMAP(i)    (0x0002 << (i))
+#define SPITFIRE_STATE_ROPMIX       0x0020
+#define SPITFIRE_STATE_CC           0x0040
+#define SPITFIRE_STATE_BITMASK      0x0080
+#define SPITFIRE_STATE_FGCOLOR      0x0100
+#define SPITFIRE_STATE_BGCOLOR      0x0200
+#define SPITFIRE_STATE_MASKORIGIN   0x0400
+
+/* Forget everything known about the engine registers. Must be called whenever
+   the engine might have been reprogrammed behind our back, such as after a 
+   mode switch or a VT switch. */
+void SpitfireResetEngineState(ScrnInfoPtr pScrn)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    int i;
 
-    patoffset = (pdrv->cxMemory * paty + patx) * pdrv->Bpp;
-    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_B,
-        patoffset, 8 - 1, 8 - 1, 
-        SPITFIRE_FORMAT_1BPP | SPITFIRE_FORMAT_INTEL);
-    pdrv->SavedAccelCmd = cmd;
+    pdrv->EngineState.valid = 0;
+    /* Video memory may have been overwritten while we were away */
+    pdrv->SeedValid = FALSE;
+    for (i = 0; i < SPITFIRE_MONO_TILES; i++)
+        pdrv->MonoTiles[i].valid = FALSE;
 }
 
-static void SpitfireSubsequentMono8x8PatternFillRect(
-	ScrnInfoPtr pScrn,
-	int patx, int paty,
-	int x, int y, int w, int h)
+/* Helper function to program a video address, width and height of a on-screen pixmap */
+static void
+SpitfireSetupPixMap(
+    SpitfirePtr pdrv,
+    unsigned int pixIndex,
+    CARD32 pixAddr,
+    CARD16 pixWidth,
+    CARD16 pixHeight,
+    CARD8 pixFormat)
 {
-    SpitfirePtr pdrv = DEVPTR(pScrn);
-    CARD32 patoffset = 0;
+    SpitfireEngineStatePtr state = &pdrv->EngineState;
+    Bool known = (state->valid & SPITFIRE_STATE_PIXMAP(pixIndex)) != 0;
 
-    /* Need to wait for previous accel operation to finish, otherwise
-     * output gets scrambled. */
-    SpitfireAccelSync(pScrn);
+    /* All pixmaps are assumed to be in framebuffer, not in system memory. */
+    pixFormat |= SPITFIRE_FORMAT_VIDEOMEM;
 
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OP_DIM_1, w - 1);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OP_DIM_2, h - 1);
- 
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_SRC, x);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_SRC, y);
+    if (known
+        && state->Pixmap[pixIndex].Base == pixAddr
+        && state->Pixmap[pixIndex].Width == pixWidth
+        && state->Pixmap[pixIndex].Height == pixHeight
+        && state->Pixmap[pixIndex].Format == pixFormat)
+        return;
 
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_PAT, patx);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_PAT, paty);
+    SpitfireStateBarrier(pdrv);
 
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_DST, x);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_DST, y);
- 
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_COMMAND, pdrv->SavedAccelCmd);
-}
-#endif
+    /* Select which of the 4 pixmaps is being defined */
+    if (!(state->valid & SPITFIRE_STATE_PIXSELECT) || state->PixSelect != pixIndex) {
+        MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_PIXMAP_SELECT, pixIndex);
+        state->PixSelect = pixIndex;
+        state->valid |= SPITFIRE_STATE_PIXSELECT;
+    }
 
-static Bool
-SpitfirePrepareSolid(PixmapPtr pPixmap, int alu, Pixel planemask, Pixel fg);
+    /* Location of this pixmap */
+    if (!known || state->Pixmap[pixIndex].Base != pixAddr)
+        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_PIXMAP_BASE, pixAddr);
 
-static void
-SpitfireSolid(PixmapPtr pPixmap, int x1, int y1, int x2, int y2);
+    /* Program dimensions of the pixmap */
+    if (!known || (state->Pixmap[pixIndex].Width != pixWidth
+                   && state->Pixmap[pixIndex].Height != pixHeight))
+        SpitfireWriteRegPair(pdrv, SPITFIRE_PIXMAP_WIDTH, pixWidth, pixHeight);
+    else if (state->Pixmap[pixIndex].Width != pixWidth)
+        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_PIXMAP_WIDTH,  pixWidth);
+    else if (state->Pixmap[pixIndex].Height != pixHeight)
+        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_PIXMAP_HEIGHT, pixHeight);
+
+    /* Program pixel format. */
+    if (!known || state->Pixmap[pixIndex].Format != pixFormat)
+        MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_PIXMAP_FORMAT, pixFormat);
+
+    state->Pixmap[pixIndex].Base = pixAddr;
+    state->Pixmap[pixIndex].Width = pixWidth;
+    state->Pixmap[pixIndex].Height = pixHeight;
+    state->Pixmap[pixIndex].Format = pixFormat;
+    state->valid |= SPITFIRE_STATE_PIXMAP(pixIndex);
+}
 
+/* Helpers to program the remaining per-operation state of the engine. Each 
+   one skips the MMIO write if the engine already holds the requested value. */
 static void
-SpitfireDoneSolid(PixmapPtr pPixmap);
+SpitfireSetRopMix(SpitfirePtr pdrv, CARD8 rop)
+{
+    SpitfireEngineStatePtr state = &pdrv->EngineState;
+
+    if ((state->valid & SPITFIRE_STATE_ROPMIX) && state->RopMix == rop)
+        return;
+    SpitfireStateBarrier(pdrv);
+    MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_ROPMIX, rop);
+    state->RopMix = rop;
+    state->valid |= SPITFIRE_STATE_ROPMIX;
+}
 
-static Bool
-SpitfirePrepareCopy(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap, int xdir, int ydir,
-					int alu, Pixel planemask);
+static void
+SpitfireSetColorCompare(SpitfirePtr pdrv, CARD32 color, CARD32 cond)
+{
+    SpitfireEngineStatePtr state = &pdrv->EngineState;
+
+    if ((state->valid & SPITFIRE_STATE_CC) 
+        && state->CCColor == color && state->CCCond == cond)
+        return;
+    SpitfireStateBarrier(pdrv);
+
+    /* The write to DEST_CC_COND spills over DEST_CC_COLOR, so both registers
+       are always written together, and in this order. */
+    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COLOR, color);
+    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COND, cond);
+    state->CCColor = color;
+    state->CCCond = cond;
+    state->valid |= SPITFIRE_STATE_CC;
+}
 
 static void
-SpitfireCopy(PixmapPtr pDstPixmap, int srcX, int srcY, int dstX, int dstY, int width, int height);
+SpitfireSetPixelBitmask(SpitfirePtr pdrv, CARD32 mask)
+{
+    SpitfireEngineStatePtr state = &pdrv->EngineState;
+
+    if ((state->valid & SPITFIRE_STATE_BITMASK) && state->PixelBitmask == mask)
+        return;
+    SpitfireStateBarrier(pdrv);
+    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_PIXEL_BITMASK, mask);
+    state->PixelBitmask = mask;
+    state->valid |= SPITFIRE_STATE_BITMASK;
+}
 
 static void
-SpitfireDoneCopy(PixmapPtr pDstPixmap);
+SpitfireSetColors(SpitfirePtr pdrv, CARD32 fg, CARD32 bg)
+{
+    SpitfireEngineStatePtr state = &pdrv->EngineState;
 
+    if (!(state->valid & SPITFIRE_STATE_FGCOLOR) || state->FgColor != fg) {
+        SpitfireStateBarrier(pdrv);
+        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_FGCOLOR, fg);
+        state->FgColor = fg;
+        state->valid |= SPITFIRE_STATE_FGCOLOR;
+    }
+    if (!(state->valid & SPITFIRE_STATE_BGCOLOR) || state->BgColor != bg) {
+        SpitfireStateBarrier(pdrv);
+        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_BGCOLOR, bg);
+        state->BgColor = bg;
+        state->valid |= SPITFIRE_STATE_BGCOLOR;
+    }
+}
 
+/* The mask map offset only changes along with the mask map itself, so it is
+   kept like the pixmap registers rather than written for every operation */
+static void
+SpitfireSetMaskOrigin(SpitfirePtr pdrv, CARD16 x, CARD16 y)
+{
+    SpitfireEngineStatePtr state = &pdrv->EngineState;
+
+    if ((state->valid & SPITFIRE_STATE_MASKORIGIN)
+        && state->MaskX == x && state->MaskY == y)
+        return;
+    SpitfireStateBarrier(pdrv);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_MAP, x, y);
+    state->MaskX = x;
+    state->MaskY = y;
+    state->valid |= SPITFIRE_STATE_MASKORIGIN;
+}
 
-static void SpitfireExaSync(ScreenPtr pScreen, int marker)
+/* Write every register the state cache knows about back to the engine, for
+   when its contents can no longer be trusted but the operation in progress
+   still relies on them. The engine must be idle. */
+static void
+SpitfireReplayEngineState(SpitfirePtr pdrv)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-    SpitfireAccelSync(pScrn);
+    SpitfireEngineStateRec saved = pdrv->EngineState;
+    int i;
+
+    pdrv->EngineState.valid = 0;
+    for (i = 0; i < 4; i++) {
+        if (saved.valid & SPITFIRE_STATE_PIXMAP(i))
+            SpitfireSetupPixMap(pdrv, i, saved.Pixmap[i].Base,
+                saved.Pixmap[i].Width, saved.Pixmap[i].Height,
+                saved.Pixmap[i].Format);
+    }
+    if (saved.valid & SPITFIRE_STATE_PIXSELECT) {
+        MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_PIXMAP_SELECT, saved.PixSelect);
+        pdrv->EngineState.PixSelect = saved.PixSelect;
+        pdrv->EngineState.valid |= SPITFIRE_STATE_PIXSELECT;
+    }
+    if (saved.valid & SPITFIRE_STATE_ROPMIX)
+        SpitfireSetRopMix(pdrv, saved.RopMix);
+    if (saved.valid & SPITFIRE_STATE_CC)
+        SpitfireSetColorCompare(pdrv, saved.CCColor, saved.CCCond);
+    if (saved.valid & SPITFIRE_STATE_BITMASK)
+        SpitfireSetPixelBitmask(pdrv, saved.PixelBitmask);
+    if (saved.valid & SPITFIRE_STATE_FGCOLOR) {
+        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_FGCOLOR, saved.FgColor);
+        pdrv->EngineState.FgColor = saved.FgColor;
+        pdrv->EngineState.valid |= SPITFIRE_STATE_FGCOLOR;
+    }
+    if (saved.valid & SPITFIRE_STATE_BGCOLOR) {
+        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_BGCOLOR, saved.BgColor);
+        pdrv->EngineState.BgColor = saved.BgColor;
+        pdrv->EngineState.valid |= SPITFIRE_STATE_BGCOLOR;
+    }
+    if (saved.valid & SPITFIRE_STATE_MASKORIGIN)
+        SpitfireSetMaskOrigin(pdrv, saved.MaskX, saved.MaskY);
 }
 
-Bool SpitfireEXAInit(ScreenPtr pScreen)
+/* The engine stopped making progress. Abort the command it is stuck on,
+   which costs that operation and any queued behind it, and bring the
+   registers back to what the driver expects them to hold. An engine that
+   keeps hanging, or does not even stop when told to, is given up on. */
+static void
+SpitfireEngineHang(SpitfirePtr pdrv)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-    SpitfirePtr pdrv = DEVPTR(pScrn);
-
-    if (!(pdrv->EXADriverPtr = exaDriverAlloc())) {
-        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-        	"Failed to allocate EXADriverRec.\n");
-        return FALSE;
+    CARD8 control = MMIO_IN8(SPITFIRE_MMIO, SPITFIRE_CP_CONTROL);
+    unsigned int loop = 0;
+    int i;
+
+    xf86DrvMsg(pdrv->ScrnIndex, X_ERROR,
+               "2D engine hung with %d commands pending, last command 0x%08x. "
+               "Terminating it.\n", (int)pdrv->CmdPending, (unsigned)pdrv->LastCmd);
+
+    MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_CP_CONTROL, control | SPITFIRE_TERMINATE_OP);
+    while ((MMIO_IN8(SPITFIRE_MMIO, SPITFIRE_CP_STATUS) & SPITFIRE_CP_BUSY)
+           && (loop++ < SPITFIRE_TERMINATE_LOOP));
+    MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_CP_CONTROL, control & ~SPITFIRE_TERMINATE_OP);
+
+    /* Whatever the dropped commands were writing into video memory is lost */
+    pdrv->CmdPending = 0;
+    pdrv->RetiredSeq = pdrv->SubmitSeq;
+    pdrv->HangSeq = pdrv->SubmitSeq;
+    pdrv->SeedValid = FALSE;
+    for (i = 0; i < SPITFIRE_MONO_TILES; i++)
+        pdrv->MonoTiles[i].valid = FALSE;
+
+    if (loop > SPITFIRE_TERMINATE_LOOP || ++pdrv->EngineHangs >= SPITFIRE_MAX_HANGS) {
+        pdrv->EngineFailed = TRUE;
+        xf86DrvMsg(pdrv->ScrnIndex, X_ERROR,
+                   "2D engine does not recover, falling back to software "
+                   "rendering.\n");
+        return;
     }
-    
-    pdrv->EXADriverPtr->exa_major = 2;
-    pdrv->EXADriverPtr->exa_minor = 0;
-    
-    /* use the linear aperture */
-    pdrv->EXADriverPtr->memoryBase = pdrv->FBBase + pScrn->fbOffset;
-    pdrv->EXADriverPtr->memorySize = pdrv->videoRambytes;
-    pdrv->EXADriverPtr->offScreenBase = pScrn->virtualY * pdrv->lDelta;
+    SpitfireReplayEngineState(pdrv);
+}
 
-    if (pdrv->EXADriverPtr->memorySize > pdrv->EXADriverPtr->offScreenBase) {
-        pdrv->EXADriverPtr->flags = EXA_OFFSCREEN_PIXMAPS;
-    } else {
-        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-            "Not enough video RAM for EXA offscreen memory manager.\n");
-    }
-    pdrv->EXADriverPtr->pixmapPitchAlign = 32;
-    pdrv->EXADriverPtr->pixmapOffsetAlign = 8;
+/* The engine takes 12-bit coordinates, which do not reach all of video memory
+   on cards with more than 4096 lines of it. XAA addresses the whole of it as
+   one pixmap, which is rebased onto a band of lines for operations below line
+   4095. Sets up pixmap index to hold lines y1 to y2, and returns the line its
+   y coordinates are then relative to. Past line 4095, y1 to y2 must be at 
+   most SPITFIRE_BAND_LINES lines, so taller rectangles are drawn in strips. */
+static int
+SpitfireFbBand(SpitfirePtr pdrv, unsigned int index, int y1, int y2)
+{
+    int band = (y2 > 0xFFF) ? (y1 & ~(SPITFIRE_BAND_LINES - 1)) : 0;
 
-    /* engine has 12 bit coordinates */
-    pdrv->EXADriverPtr->maxX = 4096;
-    pdrv->EXADriverPtr->maxY = 4096;
+    SpitfireSetupPixMap(pdrv, index, band * pdrv->lDelta, pdrv->Accel.FbWidth,
+        min(pdrv->Accel.FbLines - band, 0x1000) - 1, pdrv->Accel.FbFormat);
+    return band;
+}
 
-    /* Sync */
-    pdrv->EXADriverPtr->WaitMarker = SpitfireExaSync;
+/* Most rows a line drawn in one band may span */
+#define SPITFIRE_LINE_ROWS  (0x1000 - 4)
 
-    /* Solid fill */
-    pdrv->EXADriverPtr->PrepareSolid = SpitfirePrepareSolid;
-    pdrv->EXADriverPtr->Solid = SpitfireSolid;
-    pdrv->EXADriverPtr->DoneSolid = SpitfireDoneSolid;
+/* As SpitfireFbBand, for a line through rows y1 to y2 of pixmap C. Lines are
+   not split as readily as rectangles, so the band starts right at the line,
+   keeping BASE DWORD aligned, and y1 to y2 may span SPITFIRE_LINE_ROWS. */
+static int
+SpitfireFbLineBand(SpitfirePtr pdrv, int y1, int y2)
+{
+    int band = (y2 > 0xFFF) ? (y1 & ~3) : 0;
 
-    /* Copy */
-    pdrv->EXADriverPtr->PrepareCopy = SpitfirePrepareCopy;
-    pdrv->EXADriverPtr->Copy = SpitfireCopy;
-    pdrv->EXADriverPtr->DoneCopy = SpitfireDoneCopy;
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_C, band * pdrv->lDelta,
+        pdrv->Accel.FbWidth, min(pdrv->Accel.FbLines - band, 0x1000) - 1,
+        pdrv->Accel.FbFormat);
+    return band;
+}
 
-    if(!exaDriverInit(pScreen, pdrv->EXADriverPtr)) {
-        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-                   "exaDriverinit failed.\n");
-        return FALSE;
-    } else {
-        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
-                   "Spitfire EXA Acceleration enabled.\n");
-        return TRUE;
+/* First line of the band that strips of EXA operations on rows y to y + h - 1
+   are drawn from, h being at most SPITFIRE_BAND_LINES */
+static inline int
+SpitfireBandOf(int y, int h)
+{
+    return (y + h > 0x1000) ? (y & ~(SPITFIRE_BAND_LINES - 1)) : 0;
+}
+
+/* Apply a copy raster op to a pair of bytes. Copy ROPs ignore the pattern, so
+   the low nibble holds the result for each combination of source and
+   destination bits. */
+static inline CARD8
+SpitfireRopByte(CARD8 rop, CARD8 s, CARD8 d)
+{
+    return ((rop & 0x08) ? (s & d) : 0)
+         | ((rop & 0x04) ? (s & ~d) : 0)
+         | ((rop & 0x02) ? (~s & d) : 0)
+         | ((rop & 0x01) ? (~s & ~d) : 0);
+}
+
+/* Copy w bytes by h rows between the pixmaps of cmd with the CPU, as the
+   engine would have with the raster op it was given */
+static void
+SpitfireWideCpuCopy(SpitfirePtr pdrv, CARD32 cmd, int sx, int sy,
+                    int dx, int dy, int w, int h)
+{
+    SpitfireEngineStatePtr state = &pdrv->EngineState;
+    int src = (cmd / SPITFIRE_SRC_PIXMAP_A) & 3;
+    int dst = (cmd / SPITFIRE_DST_PIXMAP_A) & 3;
+    int srcPitch = (state->Pixmap[src].Width + 1) * 2;
+    int dstPitch = (state->Pixmap[dst].Width + 1) * 2;
+    unsigned char *s = pdrv->FBBase + state->Pixmap[src].Base + sy * srcPitch + sx;
+    unsigned char *d = pdrv->FBBase + state->Pixmap[dst].Base + dy * dstPitch + dx;
+    CARD8 rop = state->RopMix;
+    int i;
+
+    if (cmd & SPITFIRE_DEC_Y) {
+        s += (h - 1) * srcPitch;
+        d += (h - 1) * dstPitch;
+        srcPitch = -srcPitch;
+        dstPitch = -dstPitch;
+    }
+
+    SpitfireWaitIdle(pdrv);
+    for (; h > 0; h--, s += srcPitch, d += dstPitch) {
+        if (rop == 0xCC) {
+            memmove(d, s, w);
+        } else if (cmd & SPITFIRE_DEC_X) {
+            for (i = w - 1; i >= 0; i--)
+                d[i] = SpitfireRopByte(rop, s[i], d[i]);
+        } else {
+            for (i = 0; i < w; i++)
+                d[i] = SpitfireRopByte(rop, s[i], d[i]);
+        }
     }
 }
 
-static int SpitfireGetSolidROP(int rop) {
+/* Submit one column of a SpitfireWideBlit, in 16-bit pixels */
+static void
+SpitfireWideColumn(SpitfirePtr pdrv, CARD32 cmd, int sx, int sy,
+                   int dx, int dy, int w, int h, CARD32 mask)
+{
+    if (cmd & SPITFIRE_DEC_X) {
+        sx += w - 1;
+        dx += w - 1;
+    }
+    if (cmd & SPITFIRE_DEC_Y) {
+        sy += h - 1;
+        dy += h - 1;
+    }
 
-    int ALUSolidROP[16] =
-    {
-    /* GXclear      */      0x00,         /* 0 */
-    /* GXand        */      0xA0,         /* src AND dst */
-    /* GXandReverse */      0x50,         /* src AND NOT dst */
-    /* GXcopy       */      0xF0,         /* src */
-    /* GXandInverted*/      0x0A,         /* NOT src AND dst */
-    /* GXnoop       */      0xAA,         /* dst */
-    /* GXxor        */      0x5A,         /* src XOR dst */
-    /* GXor         */      0xFA,         /* src OR dst */
-    /* GXnor        */      0x05,         /* NOT src AND NOT dst */
-    /* GXequiv      */      0xA5,         /* NOT src XOR dst */
-    /* GXinvert     */      0x55,         /* NOT dst */
-    /* GXorReverse  */      0xF5,         /* src OR NOT dst */
-    /* GXcopyInverted*/     0x0F,         /* NOT src */
-    /* GXorInverted */      0xAF,         /* NOT src OR dst */
-    /* GXnand       */      0x5F,         /* NOT src OR NOT dst */
-    /* GXset        */      0xFF,         /* 1 */
+    SpitfireSetPixelBitmask(pdrv, mask);
+    SpitfireWaitCmdSlot(pdrv);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, w - 1, h - 1);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, sx, sy);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, dx, dy);
+    SpitfireKickCmd(pdrv, cmd);
+}
 
-    };
-    return (ALUSolidROP[rop]);
+/* A 24bpp pixmap with a pitch of 4096 bytes or more does not fit the width of
+   an 8bpp pixmap, so it is programmed at 16bpp instead, which halves the 
+   pitch. A run of bytes then starts or ends halfway through a 16-bit pixel
+   half of the time. Such a pixel gets a column of its own, with the byte 
+   outside the run masked off by PIXEL_BITMASK. Copies can only move bytes by
+   whole pixels, so those between offsets of different parity are done by
+   the CPU. Coordinates are in bytes, and not yet adjusted for SPITFIRE_DEC_X
+   or SPITFIRE_DEC_Y. Every plane must be enabled. */
+static void
+SpitfireWideBlit(SpitfirePtr pdrv, CARD32 cmd, int sx, int sy,
+                 int dx, int dy, int w, int h)
+{
+    Bool decX = (cmd & SPITFIRE_DEC_X) != 0;
+    int left, right, body;
+
+    if ((cmd & SPITFIRE_CMD_OPCODE_MASK) == SPITFIRE_CMD_FILL)
+        sx = dx;
+    else if ((sx ^ dx) & 1) {
+        SpitfireWideCpuCopy(pdrv, cmd, sx, sy, dx, dy, w, h);
+        return;
+    }
+
+    left = dx & 1;          /* Starts on the high byte of a pixel */
+    right = (dx + w) & 1;   /* Ends on the low byte of a pixel */
+    body = (w - left - right) / 2;
+
+    /* Columns go in the direction of the copy, like pixels do */
+    if (left && !decX)
+        SpitfireWideColumn(pdrv, cmd, sx >> 1, sy, dx >> 1, dy, 1, h, 0xFF00FF00);
+    if (right && decX)
+        SpitfireWideColumn(pdrv, cmd, (sx + w) >> 1, sy, (dx + w) >> 1, dy, 1, h,
+                           0x00FF00FF);
+    if (body)
+        SpitfireWideColumn(pdrv, cmd, (sx + left) >> 1, sy, (dx + left) >> 1, dy,
+                           body, h, ~0);
+    if (left && decX)
+        SpitfireWideColumn(pdrv, cmd, sx >> 1, sy, dx >> 1, dy, 1, h, 0xFF00FF00);
+    if (right && !decX)
+        SpitfireWideColumn(pdrv, cmd, (sx + w) >> 1, sy, (dx + w) >> 1, dy, 1, h,
+                           0x00FF00FF);
+
+    SpitfireSetPixelBitmask(pdrv, ~0);
 }
 
-int SpitfireGetCopyROP(int rop) {
+/* Full color fills at 24bpp. The engine is programmed as 8bpp there, so it
+   cannot fill with a color wider than a byte. Instead the CPU writes a few
+   pixels of packed RGB at the start of a scratch row, which the engine then
+   widens with doubling blits. Rectangles are copied from the row and, with
+   GXcopy, doubled down onto themselves. The row keeps its color until the
+   next fill with a different one. */
+#define SPITFIRE_SEED_PIXELS        16      /* Pixels written by the CPU */
+#define SPITFIRE_CPU_FILL_WIDTH     32      /* Narrower fills... */
+#define SPITFIRE_CPU_FILL_PIXELS    256     /* ... up to this area go to the CPU */
 
-    int ALUCopyROP[16] =
-    {
-       0x00, /*ROP_0 GXclear */
-       0x88, /*ROP_DSa GXand */
-       0x44, /*ROP_SDna GXandReverse */
-       0xCC, /*ROP_S GXcopy */
-       0x22, /*ROP_DSna GXandInverted */
-       0xAA, /*ROP_D GXnoop */
-       0x66, /*ROP_DSx GXxor */
-       0xEE, /*ROP_DSo GXor */
-       0x11, /*ROP_DSon GXnor */
-       0x99, /*ROP_DSxn GXequiv */
-       0x55, /*ROP_Dn GXinvert*/
-       0xDD, /*ROP_SDno GXorReverse */
-       0x33, /*ROP_Sn GXcopyInverted */
-       0xBB, /*ROP_DSno GXorInverted */
-       0x77, /*ROP_DSan GXnand */
-       0xFF, /*ROP_1 GXset */
-    };
+static void
+SpitfireSeedBlit(SpitfirePtr pdrv, CARD32 pixmaps, int srcX, int srcY,
+                 int dstX, int dstY, int w, int h)
+{
+    CARD32 cmd = SPITFIRE_CMD_BITBLT
+        | pixmaps
+        | SPITFIRE_PAT_FOREGROUND
+        | SPITFIRE_FORE_SRC_PIXMAP
+        | SPITFIRE_BACK_SRC_PIXMAP;
 
-    return (ALUCopyROP[rop]);
+    if (pdrv->Accel.Wide) {
+        SpitfireWideBlit(pdrv, cmd, srcX, srcY, dstX, dstY, w, h);
+        return;
+    }
+
+    SpitfireWaitCmdSlot(pdrv);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, w - 1, h - 1);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, srcX, srcY);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, dstX, dstY);
+    SpitfireKickCmd(pdrv, cmd);
 }
 
-static void SpitfireEXASetupPixmap(SpitfirePtr pdrv, PixmapPtr pPixmap, unsigned int index)
+/* Fill the scratch row with color. The row starts at (x, y) of the pixmaps
+   selected by srcDst, is mapped at row, and is pdrv->SeedBytes wide. The
+   caller has set up GXcopy with every plane enabled. */
+static void
+SpitfireSeedRow(SpitfirePtr pdrv, unsigned char *row, CARD32 srcDst,
+                int x, int y, CARD32 color)
 {
-    unsigned long xpix, ypix;
+    int i, n;
+
+    if (pdrv->SeedValid && pdrv->SeedColor == color)
+        return;
+
+    /* Earlier fills may still be reading the row */
+    SpitfireWaitSeq(pdrv, pdrv->SeedSeq);
+    for (i = 0; i < SPITFIRE_SEED_PIXELS * 3; i += 3) {
+        row[i] = color;
+        row[i + 1] = color >> 8;
+        row[i + 2] = color >> 16;
+    }
+
+    for (n = SPITFIRE_SEED_PIXELS * 3; n < pdrv->SeedBytes; n *= 2)
+        SpitfireSeedBlit(pdrv, srcDst, x, y, x + n, y,
+                         min(n, pdrv->SeedBytes - n), 1);
 
+    pdrv->SeedColor = color;
+    pdrv->SeedValid = TRUE;
+    pdrv->SeedSeq = pdrv->SubmitSeq;
+}
 
-    xpix = exaGetPixmapPitch(pPixmap) / (pPixmap->drawable.bitsPerPixel >> 3);
-    ypix = pPixmap->drawable.height;
-    if (pPixmap->drawable.bitsPerPixel != 24) {
-        CARD8 pixFormat = 0;
+/* Fill w by h pixels at (x, y) of pixmap C, mapped at base with the given
+   pitch, from the scratch row at (seedX, seedY) of pixmap A. seedX must be
+   even, so that SpitfireWideBlit can start from either of the first two
+   pixels of the row, whichever has the parity of the destination. */
+static void
+SpitfireSeedFill(SpitfirePtr pdrv, unsigned char *base, int pitch,
+                 int x, int y, int w, int h, int seedX, int seedY)
+{
+    unsigned char line[SPITFIRE_CPU_FILL_WIDTH * 3];
+    CARD32 color = pdrv->Accel.FillColor;
+    int span = pdrv->SeedBytes - (pdrv->Accel.Wide ? 3 : 0);
+    int i, n, cx, cw, sx;
+
+    /* Small fills are cheaper done by the CPU, once the engine is done with
+       whatever it may be drawing there */
+    if (pdrv->Accel.FillCpu && w <= SPITFIRE_CPU_FILL_WIDTH
+        && w * h <= SPITFIRE_CPU_FILL_PIXELS && SpitfireEngineIdle(pdrv)) {
+        for (i = 0; i < w * 3; i += 3) {
+            line[i] = color;
+            line[i + 1] = color >> 8;
+            line[i + 2] = color >> 16;
+        }
+        pdrv->UploadCopy(base + y * pitch + x * 3, pitch, line, 0, w * 3, h);
+        return;
+    }
 
-        switch (pPixmap->drawable.bitsPerPixel) {
-        case 8:  pixFormat = SPITFIRE_FORMAT_8BPP;  break;
-        case 16: pixFormat = SPITFIRE_FORMAT_16BPP; break;
-        case 32: pixFormat = SPITFIRE_FORMAT_32BPP; break;
+    x *= 3;
+    w *= 3;
+    for (cx = x; cx < x + w; cx += cw) {
+        cw = min(x + w - cx, span);
+        sx = seedX + (pdrv->Accel.Wide ? 3 * (cx & 1) : 0);
+
+        SpitfireSeedBlit(pdrv, SPITFIRE_SRC_PIXMAP_A | SPITFIRE_DST_PIXMAP_C,
+                         sx, seedY, cx, y, cw, 1);
+        for (i = 1; i < h; i += n) {
+            if (pdrv->Accel.FillCopy) {
+                n = min(i, h - i);
+                SpitfireSeedBlit(pdrv, SPITFIRE_SRC_PIXMAP_C | SPITFIRE_DST_PIXMAP_C,
+                                 cx, y, cx, y + i, cw, n);
+            } else {
+                n = 1;
+                SpitfireSeedBlit(pdrv, SPITFIRE_SRC_PIXMAP_A | SPITFIRE_DST_PIXMAP_C,
+                                 sx, seedY, cx, y + i, cw, 1);
+            }
         }
-        SpitfireSetupPixMap(pdrv, index, 
-            exaGetPixmapOffset(pPixmap), xpix - 1, ypix - 1, 
-            pixFormat);
-    } else {
-        SpitfireSetupPixMap(pdrv, index, 
-            exaGetPixmapOffset(pPixmap), exaGetPixmapPitch(pPixmap) - 1, ypix - 1,
-            SPITFIRE_FORMAT_8BPP);
     }
+    pdrv->SeedSeq = pdrv->SubmitSeq;
 }
 
-static Bool
-SpitfirePrepareSolid(PixmapPtr pPixmap, int alu, Pixel planemask, Pixel fg)
+/* Engine direction bits for a line octant, given as the mi octant flags */
+static inline CARD32
+SpitfireLineOctant(int octant)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pPixmap->drawable.pScreen);
-    SpitfirePtr pdrv = DEVPTR(pScrn);
-    unsigned int cmd;
+    CARD32 cmd = 0;
 
-    cmd = SPITFIRE_CMD_FILL
-        | SPITFIRE_PAT_FOREGROUND
-        | SPITFIRE_DST_PIXMAP_C
-        | SPITFIRE_FORE_SRC_FGCOLOR /* <-- Use foreground color, not pixmap, as source */
-        | SPITFIRE_BACK_SRC_BGCOLOR;/* <-- Use background color, not pixmap, as source */
+    if (octant & YMAJOR)      cmd |= SPITFIRE_YMAJOR;
+    if (octant & XDECREASING) cmd |= SPITFIRE_DEC_X;
+    if (octant & YDECREASING) cmd |= SPITFIRE_DEC_Y;
+    return cmd;
+}
 
-    if (pPixmap->drawable.bitsPerPixel == 24) {
-        /* Cannot accelerate solid fill for 24-bit if not grayscale */
-        if ((((fg & 0x0000FF) != ((fg >> 8) & 0x0000FF)) || ((fg & 0x0000FF) != ((fg >> 16) & 0x0000FF))))
-            return FALSE;
+/* Draw len pixels of a zero-width line starting at (x, y). The Bresenham
+   terms are given as fb uses them: e1 is added to the error term e on every
+   pixel, and once the sum is no longer negative, a step is also taken along
+   the minor axis and e3 is added. The engine tests its error term before
+   adding to it, so it has to start one step ahead. */
+static inline void
+SpitfireSubmitLine(SpitfirePtr pdrv, CARD32 cmd, int x, int y,
+                   int e, int e1, int e3, int len)
+{
+    /* Wait for room in the coprocessor command buffer */
+    SpitfireWaitCmdSlot(pdrv);
 
-        /* Reject pitches greater than 0xFFF on 24bpp */
-        if (exaGetPixmapPitch(pPixmap) > 0xFFF)
-            return FALSE;
-    }
+    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_BRESENHAM_ERR, e + e1);
+    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_BRESENHAM_K1, e1);
+    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_BRESENHAM_K2, e1 + e3);
+    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OP_DIM_1, len - 1);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x, y);
+    pdrv->PendingPixels += len;
 
-    /* Need to wait for previous accel operation to finish, otherwise
-     * output gets scrambled. */
-    SpitfireAccelSync(pScrn);
+    SpitfireKickCmd(pdrv, cmd);
+}
 
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_FGCOLOR, fg);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_BGCOLOR, fg);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_PIXEL_BITMASK, planemask);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COLOR, 0);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COND, 6); /* Always update */
-    MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_ROPMIX, SpitfireGetCopyROP(alu));
+/* Work out the Bresenham terms of the line from (x1, y1) to (x2, y2), as
+   SpitfireSubmitLine takes them, and its mi octant. Returns the number of
+   pixels up to, but not including, the last point. */
+static int
+SpitfireLineTerms(int x1, int y1, int x2, int y2, unsigned int bias,
+                  int *adx, int *ady, int *e, int *e1, int *e3, int *octant)
+{
+    int signdx, signdy, e2, len;
+
+    CalcLineDeltas(x1, y1, x2, y2, *adx, *ady, signdx, signdy, 1, 1, *octant);
+    if (*adx > *ady) {
+        *e1 = *ady << 1;
+        e2 = *e1 - (*adx << 1);
+        *e = *e1 - *adx;
+        len = *adx;
+    } else {
+        *e1 = *adx << 1;
+        e2 = *e1 - (*ady << 1);
+        *e = *e1 - *ady;
+        len = *ady;
+        SetYMajorOctant(*octant);
+    }
+    FIXUP_ERROR(*e, *octant, bias);
 
-    /* Set up destination pixmap */
-    SpitfireEXASetupPixmap(pdrv, pPixmap, SPITFIRE_INDEX_PIXMAP_C);
-    
-    pdrv->SavedAccelCmd = cmd;
-    return TRUE;
+    /* Adjust error terms to compare against zero */
+    *e3 = e2 - *e1;
+    *e = *e - *e1;
+    return len;
 }
 
+/* Draw the line from (x1, y1) to (x2, y2), clipped to the given boxes, with
+   the pixels that fbSegment would touch, so that lines drawn by the engine
+   and by fb always meet. (dx, dy) is added to the coordinates of every line
+   sent to the engine, after clipping. */
 static void
-SpitfireSolid(PixmapPtr pPixmap, int x1, int y1, int x2, int y2)
+SpitfireClipLine(SpitfirePtr pdrv, CARD32 cmd, int x1, int y1, int x2, int y2,
+                 Bool drawLast, unsigned int bias, BoxPtr pBox, int nBox,
+                 int dx, int dy)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pPixmap->drawable.pScreen);
-    SpitfirePtr pdrv = DEVPTR(pScrn);
-    int w = x2 - x1;
-    int h = y2 - y1;
-
-    /* On 24bpp, we are pretending to work at 8bpp, so triple all dimensions */
-    if (pPixmap->drawable.bitsPerPixel == 24) {
-        x1 *= 3; w *= 3;
+    int adx, ady, e, e1, e3, len, octant;
+    int oc1, oc2;
+
+    len = SpitfireLineTerms(x1, y1, x2, y2, bias, &adx, &ady, &e, &e1, &e3, &octant);
+    cmd |= SpitfireLineOctant(octant);
+    if (drawLast)
+        len++;
+
+    for (; nBox > 0; nBox--, pBox++) {
+        int nx1 = x1, ny1 = y1, nx2 = x2, ny2 = y2;
+        int clip1 = 0, clip2 = 0;
+        int err = e, n;
+
+        oc1 = oc2 = 0;
+        OUTCODES(oc1, x1, y1, pBox);
+        OUTCODES(oc2, x2, y2, pBox);
+        if (!(oc1 | oc2)) {
+            /* The boxes do not overlap, so no other one can hold any of it */
+            if (len)
+                SpitfireSubmitLine(pdrv, cmd, x1 + dx, y1 + dy, e, e1, e3, len);
+            return;
+        }
+        if (oc1 & oc2)
+            continue;
+
+        if (miZeroClipLine(pBox->x1, pBox->y1, pBox->x2 - 1, pBox->y2 - 1,
+                           &nx1, &ny1, &nx2, &ny2, adx, ady, &clip1, &clip2,
+                           octant, bias, oc1, oc2) == -1)
+            continue;
+
+        n = (octant & YMAJOR) ? abs(ny2 - ny1) : abs(nx2 - nx1);
+        if (clip2 || drawLast)
+            n++;
+        if (!n)
+            continue;
+
+        /* Unwind the error term to the first point drawn */
+        if (clip1) {
+            if (octant & YMAJOR)
+                err += e3 * abs(nx1 - x1) + e1 * abs(ny1 - y1);
+            else
+                err += e3 * abs(ny1 - y1) + e1 * abs(nx1 - x1);
+        }
+        SpitfireSubmitLine(pdrv, cmd, nx1 + dx, ny1 + dy, err, e1, e3, n);
     }
+}
 
-    /* Need to wait for previous accel operation to finish, otherwise
-     * output gets scrambled. */
-    SpitfireAccelSync(pScrn);
+/* Short-stroke vectors draw up to 15 pixels along one of the 8 directions
+   each, and four of them fit in a single write to SPITFIRE_SHORT_STROKE, 
+   which starts them. The engine keeps its position in the destination 
+   offset registers from one stroke to the next, so a run of strokes only 
+   needs its start point and the command written once. */
+typedef struct {
+    CARD32 cmd;         /* Short-stroke command, with the destination and ROP */
+    CARD32 word;        /* Strokes not written yet, the first in the low byte */
+    int count;          /* ... and how many */
+    int x, y;           /* End of the strokes so far, in screen coordinates */
+    int dx, dy;         /* Offset from screen to pixmap coordinates */
+    Bool posSet;        /* Engine position is at the start of word */
+    Bool cmdSet;        /* Engine has been given cmd */
+} SpitfireStrokeRec, *SpitfireStrokePtr;
+
+/* Stroke direction, indexed by the sign of the y and x steps, plus one */
+static const CARD8 SpitfireStrokeDir[3][3] = {
+    { 3, 2, 1 },
+    { 4, 0, 0 },
+    { 5, 6, 7 }
+};
 
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OP_DIM_1, w - 1);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OP_DIM_2, h - 1);
+static void
+SpitfireStrokeInit(SpitfireStrokePtr s, CARD32 cmd, int dx, int dy)
+{
+    s->cmd = (cmd & ~SPITFIRE_CMD_OPCODE_MASK)
+           | SPITFIRE_CMD_SHORT_STROKE_WRITE | SPITFIRE_DRAW_OMIT_LAST;
+    s->word = 0;
+    s->count = 0;
+    s->dx = dx;
+    s->dy = dy;
+    s->posSet = FALSE;
+    s->cmdSet = FALSE;
+}
 
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_SRC, x1);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_DST, x1);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_SRC, y1);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_DST, y1);
+/* Send the strokes gathered so far. Unused bytes are zero, which is a move
+   by no pixels. */
+static void
+SpitfireStrokeFlush(SpitfirePtr pdrv, SpitfireStrokePtr s)
+{
+    if (!s->count)
+        return;
+
+    /* Wait for room in the coprocessor command buffer */
+    SpitfireWaitCmdSlot(pdrv);
+
+    if (!s->posSet)
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, 
+                             s->x + s->dx, s->y + s->dy);
+    if (!s->cmdSet)
+        MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_COMMAND, s->cmd);
+    s->posSet = s->cmdSet = TRUE;
+
+    SpitfireKickStrokes(pdrv, s->word);
+    s->word = 0;
+    s->count = 0;
+}
 
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_COMMAND, pdrv->SavedAccelCmd);
+static inline void
+SpitfireStrokeAdd(SpitfirePtr pdrv, SpitfireStrokePtr s, CARD8 stroke)
+{
+    s->word |= (CARD32)stroke << (s->count * 8);
+    if (++s->count == 4)
+        SpitfireStrokeFlush(pdrv, s);
 }
 
+/* Something other than strokes is about to be sent to the engine */
 static void
-SpitfireDoneSolid(PixmapPtr pPixmap)
+SpitfireStrokeBreak(SpitfirePtr pdrv, SpitfireStrokePtr s)
 {
-    // Nothing needs to be done here.
+    SpitfireStrokeFlush(pdrv, s);
+    s->posSet = s->cmdSet = FALSE;
 }
 
+/* Queue the line from (x1, y1) to (x2, y2) as short strokes, if it runs 
+   along one of the 8 directions and lies within the box. Such lines are 
+   pixelized the same whatever the bias, and the strokes, which skip their
+   last pixel, join up exactly like fb joins the segments of a polyline. 
+   Returns FALSE if the line must be drawn some other way. */
 static Bool
-SpitfirePrepareCopy(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap, int xdir, int ydir,
-					int alu, Pixel planemask)
+SpitfireStrokeLine(SpitfirePtr pdrv, SpitfireStrokePtr s, BoxPtr pBox,
+                   int x1, int y1, int x2, int y2, Bool drawLast)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pSrcPixmap->drawable.pScreen);
-    SpitfirePtr pdrv = DEVPTR(pScrn);
-    unsigned int cmd;
-
-    cmd = SPITFIRE_CMD_BITBLT
-        | SPITFIRE_SRC_PIXMAP_A
-        | SPITFIRE_PAT_FOREGROUND
-        | SPITFIRE_DST_PIXMAP_C
-        | SPITFIRE_FORE_SRC_PIXMAP
-        | SPITFIRE_BACK_SRC_PIXMAP;
-    if (xdir < 0) cmd |= SPITFIRE_DEC_X;
-    if (ydir < 0) cmd |= SPITFIRE_DEC_Y;
+    int adx = abs(x2 - x1), ady = abs(y2 - y1);
+    int n = max(adx, ady);
+    CARD8 dir;
 
-    /* Cannot accelerate copy when just one of the pixmaps is 24bpp */
-    if ((pSrcPixmap->drawable.bitsPerPixel == 24 || pDstPixmap->drawable.bitsPerPixel == 24)
-        && pSrcPixmap->drawable.bitsPerPixel != pDstPixmap->drawable.bitsPerPixel)
+    if (adx && ady && adx != ady)
+        return FALSE;
+    if (x1 < pBox->x1 || x1 >= pBox->x2 || y1 < pBox->y1 || y1 >= pBox->y2 ||
+        x2 < pBox->x1 || x2 >= pBox->x2 || y2 < pBox->y1 || y2 >= pBox->y2)
         return FALSE;
 
-    if (pDstPixmap->drawable.bitsPerPixel == 24) {
-        /* Reject pitches greater than 0xFFF on 24bpp */
-        if (exaGetPixmapPitch(pSrcPixmap) > 0xFFF) return FALSE;
-        if (exaGetPixmapPitch(pDstPixmap) > 0xFFF) return FALSE;
+    /* Continue the current run if it ends where this line starts */
+    if (!s->count && !s->posSet) {
+        s->x = x1;
+        s->y = y1;
+    } else if (s->x != x1 || s->y != y1) {
+        SpitfireStrokeFlush(pdrv, s);
+        s->posSet = FALSE;
+        s->x = x1;
+        s->y = y1;
     }
 
+    dir = SpitfireStrokeDir[(y2 > y1) - (y2 < y1) + 1][(x2 > x1) - (x2 < x1) + 1]
+        << SPITFIRE_STROKE_DIR_SHIFT;
+    for (; n > 0; n -= SPITFIRE_STROKE_LEN_MASK)
+        SpitfireStrokeAdd(pdrv, s, dir | SPITFIRE_STROKE_DRAW 
+                          | min(n, SPITFIRE_STROKE_LEN_MASK));
 
-    /* Need to wait for previous accel operation to finish, otherwise
-     * output gets scrambled. */
-    SpitfireAccelSync(pScrn);
+    /* A stroke one pixel long draws just the pixel it starts on */
+    if (drawLast)
+        SpitfireStrokeAdd(pdrv, s, SPITFIRE_STROKE_DRAW | 1);
 
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_PIXEL_BITMASK, planemask);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COLOR, 0);
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_DEST_CC_COND, 6); /* Always update */
-    MMIO_OUT8(SPITFIRE_MMIO, SPITFIRE_ROPMIX, SpitfireGetCopyROP(alu));
-    
-    /* Set up source and destination pixmaps */
-    SpitfireEXASetupPixmap(pdrv, pSrcPixmap, SPITFIRE_INDEX_PIXMAP_A);
-    SpitfireEXASetupPixmap(pdrv, pDstPixmap, SPITFIRE_INDEX_PIXMAP_C);
-
-    pdrv->SavedAccelCmd = cmd;
+    s->x = x2 + (drawLast ? 1 : 0);
+    s->y = y2;
     return TRUE;
 }
 
+#ifdef HAVE_XAA_H
+/* XAA sets a clipping rectangle before some of the operations in ClippingFlags,
+   which are then drawn unclipped, and disables it once they are done. */
 static void
-SpitfireCopy(PixmapPtr pDstPixmap, int srcX, int srcY, int dstX, int dstY, int width, int height)
+SpitfireSetClippingRectangle(
+    ScrnInfoPtr pScrn,
+    int left, int top,
+    int right, int bottom)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDstPixmap->drawable.pScreen);
     SpitfirePtr pdrv = DEVPTR(pScrn);
 
-    /* On 24bpp, we are pretending to work at 8bpp, so triple all dimensions */
-    if (pDstPixmap->drawable.bitsPerPixel == 24) {
-        srcX *= 3; dstX *= 3; width *= 3;
+    pdrv->Accel.Clip = TRUE;
+    pdrv->Accel.ClipX1 = left;
+    pdrv->Accel.ClipY1 = top;
+    pdrv->Accel.ClipX2 = right;
+    pdrv->Accel.ClipY2 = bottom;
+}
+
+static void
+SpitfireDisableClipping(
+    ScrnInfoPtr pScrn)
+{
+    DEVPTR(pScrn)->Accel.Clip = FALSE;
+}
+
+/* With SPITFIRE_MASK_BOUNDARY, the engine only draws within the extent of the
+   mask map, placed at the mask map offset in the destination. Its bits are
+   not read in that mode, which SpitfireProbeMaskBoundary checks before XAA
+   is given the clipper, so the mask map is not given any memory. Programs
+   the clipping rectangle, if any, for an operation drawn into the band of the
+   framebuffer starting at line band, and adds the mask bits to cmd. Returns
+   FALSE if no part of the band is inside the rectangle. */
+static Bool
+SpitfireXAAScissor(SpitfirePtr pdrv, int band, CARD32 *cmd)
+{
+    int y1, y2;
+
+    if (!pdrv->Accel.Clip)
+        return TRUE;
+
+    y1 = max(pdrv->Accel.ClipY1 - band, 0);
+    y2 = min(pdrv->Accel.ClipY2 - band, 0xFFF);
+    if (y1 > y2)
+        return FALSE;
+
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_MASK, 0,
+        pdrv->Accel.ClipX2 - pdrv->Accel.ClipX1, y2 - y1, SPITFIRE_FORMAT_1BPP);
+    SpitfireSetMaskOrigin(pdrv, pdrv->Accel.ClipX1, y1);
+    *cmd |= SPITFIRE_MASK_BOUNDARY;
+    return TRUE;
+}
+
+/* The documentation does not say whether SPITFIRE_MASK_BOUNDARY reads the
+   bits of the mask map. Fill a 32 by 8 rectangle through a map 16 pixels
+   wide, all of whose bits are clear: if the engine read them, nothing would
+   be drawn, and if it ignored the extent, the right half would be. The map
+   and the rectangle take the first 64 + 256 bytes of video memory at
+   offset, which is not in use yet. */
+static Bool
+SpitfireProbeMaskBoundary(SpitfirePtr pdrv, CARD32 offset)
+{
+    unsigned char *map = pdrv->FBBase + offset;
+    unsigned char *dst = map + 64;
+    int i;
+
+    memset(map, 0, 64 + 256);
+
+    SpitfireSetColors(pdrv, 0xFF, 0xFF);
+    SpitfireSetPixelBitmask(pdrv, ~0);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, 0xCC); /* GXcopy */
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_C,
+        offset + 64, 32 - 1, 8 - 1, SPITFIRE_FORMAT_8BPP);
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_MASK,
+        offset, 16 - 1, 8 - 1, SPITFIRE_FORMAT_1BPP);
+    SpitfireSetMaskOrigin(pdrv, 0, 0);
+
+    SpitfireWaitCmdSlot(pdrv);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, 32 - 1, 8 - 1);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, 0, 0);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, 0, 0);
+    SpitfireKickCmd(pdrv, SPITFIRE_CMD_FILL
+        | SPITFIRE_PAT_FOREGROUND
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_FGCOLOR
+        | SPITFIRE_BACK_SRC_BGCOLOR
+        | SPITFIRE_MASK_BOUNDARY);
+    SpitfireWaitIdle(pdrv);
+    if (pdrv->EngineFailed)
+        return FALSE;
+
+    for (i = 0; i < 256; i++)
+        if (dst[i] != (((i & 31) < 16) ? 0xFF : 0))
+            break;
+    if (i < 256) {
+        xf86DrvMsg(pdrv->ScrnIndex, X_INFO,
+                   "Engine reads the mask map for boundary clipping, "
+                   "XAA clipping disabled.\n");
+        return FALSE;
     }
+    return TRUE;
+}
+
+/* The planemask applies to each byte in 24 bpp, where it is always full */
+static void
+SpitfireXAAPlanemask(SpitfirePtr pdrv, unsigned int planemask)
+{
+    SpitfireSetPixelBitmask(pdrv, (pdrv->Bpp == 3) ? ~0 : planemask);
+}
 
-    /* Need to wait for previous accel operation to finish, otherwise
-     * output gets scrambled. */
-    SpitfireAccelSync(pScrn);
+/* XAA keeps calling the functions below after the engine has been given up
+   on, and cannot be told to stop. They then draw with the CPU instead, from
+   what the setup functions keep in pdrv->Accel for that. Nothing is left
+   in flight by then, so the framebuffer is accessed without waiting. */
 
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OP_DIM_1, width - 1);
-    MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OP_DIM_2, height - 1);
+/* Keep the raster op, planemask and colors of the operation being set up */
+static void
+SpitfireCpuSetup(SpitfirePtr pdrv, int rop, unsigned int planemask, int fg, int bg)
+{
+    SpitfireAccelContextPtr accel = &pdrv->Accel;
 
-    /* When specifying SPITFIRE_DEC_[XY], we need to specify the rightmost or
-     * bottommost pixel coordinate, as required. */
-    if (pdrv->SavedAccelCmd & SPITFIRE_DEC_X) {
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_SRC, srcX + width - 1);
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_DST, dstX + width - 1);
-    } else {
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_SRC, srcX);
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_X_DST, dstX);
+    accel->CpuRop = rop;
+    accel->CpuPlanemask = planemask;
+    accel->CpuFg = fg;
+    accel->CpuBg = bg;
+    accel->CpuTrans = -1;
+}
+
+/* Apply an X raster op to a pair of pixels */
+static inline CARD32
+SpitfireCpuRop(int rop, CARD32 s, CARD32 d)
+{
+    return ((rop & 0x01) ? (s & d) : 0)
+         | ((rop & 0x02) ? (s & ~d) : 0)
+         | ((rop & 0x04) ? (~s & d) : 0)
+         | ((rop & 0x08) ? (~s & ~d) : 0);
+}
+
+static CARD32
+SpitfireCpuRead(SpitfirePtr pdrv, int x, int y)
+{
+    unsigned char *p = pdrv->FBBase + y * pdrv->lDelta + x * pdrv->Bpp;
+
+    switch (pdrv->Bpp) {
+    case 1:  return *p;
+    case 2:  return *(CARD16 *)p;
+    case 3:  return p[0] | (p[1] << 8) | (p[2] << 16);
+    default: return *(CARD32 *)p;
     }
-    if (pdrv->SavedAccelCmd & SPITFIRE_DEC_Y) {
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_SRC, srcY + height - 1);
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_DST, dstY + height - 1);
-    } else {
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_SRC, srcY);
-        MMIO_OUT16(SPITFIRE_MMIO, SPITFIRE_OFFSET_Y_DST, dstY);
+}
+
+/* Draw a pixel with the raster op and planemask of the current operation,
+   unless it is outside the clipping rectangle */
+static void
+SpitfireCpuPixel(SpitfirePtr pdrv, int x, int y, CARD32 src)
+{
+    SpitfireAccelContextPtr accel = &pdrv->Accel;
+    unsigned char *p = pdrv->FBBase + y * pdrv->lDelta + x * pdrv->Bpp;
+    CARD32 d;
+
+    if (accel->Clip && (x < accel->ClipX1 || x > accel->ClipX2
+                        || y < accel->ClipY1 || y > accel->ClipY2))
+        return;
+
+    d = SpitfireCpuRead(pdrv, x, y);
+    d = (d & ~accel->CpuPlanemask)
+      | (SpitfireCpuRop(accel->CpuRop, src, d) & accel->CpuPlanemask);
+    switch (pdrv->Bpp) {
+    case 1:  *p = d; break;
+    case 2:  *(CARD16 *)p = d; break;
+    case 3:  p[0] = d; p[1] = d >> 8; p[2] = d >> 16; break;
+    default: *(CARD32 *)p = d; break;
     }
+}
+
+/* Fill w by h pixels at (x, y) with the foreground color */
+static void
+SpitfireCpuFill(SpitfirePtr pdrv, int x, int y, int w, int h)
+{
+    int i, j;
 
-    MMIO_OUT32(SPITFIRE_MMIO, SPITFIRE_COMMAND, pdrv->SavedAccelCmd);
+    for (j = 0; j < h; j++)
+        for (i = 0; i < w; i++)
+            SpitfireCpuPixel(pdrv, x + i, y + j, pdrv->Accel.CpuFg);
 }
 
+/* Copy w by h pixels from (x1, y1) to (x2, y2), going the way XAA asked for
+   so that overlapping rectangles come out right */
 static void
-SpitfireDoneCopy(PixmapPtr pDstPixmap)
+SpitfireCpuCopy(SpitfirePtr pdrv, int x1, int y1, int x2, int y2, int w, int h)
 {
-    // Nothing needs to be done here.
+    SpitfireAccelContextPtr accel = &pdrv->Accel;
+    int i, j, x, y;
+    CARD32 s;
+
+    for (j = 0; j < h; j++) {
+        y = (accel->CpuYDir < 0) ? h - 1 - j : j;
+        for (i = 0; i < w; i++) {
+            x = (accel->CpuXDir < 0) ? w - 1 - i : i;
+            s = SpitfireCpuRead(pdrv, x1 + x, y1 + y);
+            if (accel->CpuTrans == -1 || s != (CARD32)accel->CpuTrans)
+                SpitfireCpuPixel(pdrv, x2 + x, y2 + y, s);
+        }
+    }
 }
 
+/* Fill w by h pixels at (x, y) with the mono pattern in CpuMono, pixel
+   (patx, paty) of which is at the top left */
+static void
+SpitfireCpuMonoFill(SpitfirePtr pdrv, int patx, int paty,
+                    int x, int y, int w, int h)
+{
+    SpitfireAccelContextPtr accel = &pdrv->Accel;
+    int i, j;
+
+    for (j = 0; j < h; j++) {
+        CARD8 row = accel->CpuMono[(paty + j) & 7];
+
+        for (i = 0; i < w; i++) {
+            if (row & (1 << ((patx + i) & 7)))
+                SpitfireCpuPixel(pdrv, x + i, y + j, accel->CpuFg);
+            else if (accel->CpuBg != -1)
+                SpitfireCpuPixel(pdrv, x + i, y + j, accel->CpuBg);
+        }
+    }
+}
+
+/* Same with the color pattern in the pixmap cache */
+static void
+SpitfireCpuColorFill(SpitfirePtr pdrv, int patx, int paty,
+                     int x, int y, int w, int h)
+{
+    SpitfireAccelContextPtr accel = &pdrv->Accel;
+    CARD32 pattern[8][8], s;
+    int i, j;
+
+    for (j = 0; j < 8; j++)
+        for (i = 0; i < 8; i++)
+            pattern[j][i] = SpitfireCpuRead(pdrv, accel->CpuPatX + i,
+                                            accel->CpuPatY + j);
+
+    for (j = 0; j < h; j++) {
+        for (i = 0; i < w; i++) {
+            s = pattern[(paty + j) & 7][(patx + i) & 7];
+            if (accel->CpuTrans == -1 || s != (CARD32)accel->CpuTrans)
+                SpitfireCpuPixel(pdrv, x + i, y + j, s);
+        }
+    }
+}
+
+/* Draw len pixels of a zero-width line from (x, y) in the foreground color,
+   with the Bresenham terms SpitfireSubmitLine takes */
+static void
+SpitfireCpuLine(SpitfirePtr pdrv, int x, int y, int e, int e1, int e3,
+                int len, int octant)
+{
+    int sx = (octant & XDECREASING) ? -1 : 1;
+    int sy = (octant & YDECREASING) ? -1 : 1;
+
+    for (; len > 0; len--) {
+        SpitfireCpuPixel(pdrv, x, y, pdrv->Accel.CpuFg);
+        e += e1;
+        if (e >= 0) {
+            e += e3;
+            if (octant & YMAJOR)
+                x += sx;
+            else
+                y += sy;
+        }
+        if (octant & YMAJOR)
+            y += sy;
+        else
+            x += sx;
+    }
+}
+
+static void 
+SpitfireSetupForScreenToScreenCopy(
+    ScrnInfoPtr pScrn,
+    int xdir, 
+    int ydir,
+    int rop,
+    unsigned planemask,
+    int transparency_color)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    unsigned int cmd;
+
+    SpitfireCpuSetup(pdrv, rop, planemask, 0, -1);
+    pdrv->Accel.CpuTrans = transparency_color;
+    pdrv->Accel.CpuXDir = xdir;
+    pdrv->Accel.CpuYDir = ydir;
+    if (pdrv->EngineFailed)
+        return;
+
+    cmd = SPITFIRE_CMD_BITBLT
+        | SPITFIRE_SRC_PIXMAP_A
+        | SPITFIRE_PAT_FOREGROUND
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_PIXMAP
+        | SPITFIRE_BACK_SRC_PIXMAP;
+    if (xdir == -1) cmd |= SPITFIRE_DEC_X;
+    if (ydir == -1) cmd |= SPITFIRE_DEC_Y;
+
+    SpitfireXAAPlanemask(pdrv, planemask);
+    if (transparency_color != -1) {
+        SpitfireSetColorCompare(pdrv, transparency_color, 2); /* Update on != transparency_color */
+    } else {
+        SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    }
+    SpitfireSetRopMix(pdrv, XAAGetCopyROP(rop));
+
+    /* Source and destination pixmaps are set up for each rectangle, on the
+       bands of the framebuffer that it covers */
+    pdrv->SavedAccelCmd = cmd;
+}
+
+/* The per-rectangle functions are written once as inline templates, with the
+   screen depth as a constant argument, and instantiated for each depth by
+   SPITFIRE_XAA_BPP_FUNCS so that the 24bpp handling compiles away elsewhere. */
+static inline void 
+SpitfireXAACopyRect(
+    SpitfirePtr pdrv,
+    int x1,
+    int y1,
+    int x2,
+    int y2,
+    int w,
+    int h,
+    const int bpp)
+{
+    y1 -= SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_A, y1, y1 + h - 1);
+    y2 -= SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_C, y2, y2 + h - 1);
+
+    /* On 24bpp, we are pretending to work at 8bpp, so triple all dimensions */
+    if (bpp == 24) {
+        x1 *= 3; x2 *= 3; w *= 3;
+        if (pdrv->Accel.Wide) {
+            SpitfireWideBlit(pdrv, pdrv->SavedAccelCmd, x1, y1, x2, y2, w, h);
+            return;
+        }
+    }
+
+    /* Wait for room in the coprocessor command buffer */
+    SpitfireWaitCmdSlot(pdrv);
+
+    /* When specifying SPITFIRE_DEC_[XY], we need to specify the rightmost or
+     * bottommost pixel coordinate, as required. */
+    if (pdrv->SavedAccelCmd & SPITFIRE_DEC_X) {
+        x1 += w - 1;
+        x2 += w - 1;
+    }
+    if (pdrv->SavedAccelCmd & SPITFIRE_DEC_Y) {
+        y1 += h - 1;
+        y2 += h - 1;
+    }
+
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, w - 1, h - 1);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, x1, y1);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x2, y2);
+
+    SpitfireKickCmd(pdrv, pdrv->SavedAccelCmd);
+}
+
+static inline void 
+SpitfireSubsequentScreenToScreenCopyTmpl(
+    ScrnInfoPtr pScrn,
+    int x1,
+    int y1,
+    int x2,
+    int y2,
+    int w,
+    int h,
+    const int bpp)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    int n;
+
+    if (pdrv->EngineFailed) {
+        SpitfireCpuCopy(pdrv, x1, y1, x2, y2, w, h);
+        return;
+    }
+
+    if (max(y1, y2) + h <= 0x1000) {
+        SpitfireXAACopyRect(pdrv, x1, y1, x2, y2, w, h, bpp);
+        return;
+    }
+
+    /* Past line 4095, copy in strips that each fit a band, bottom up if the
+       engine was asked to */
+    for (; h > 0; h -= n) {
+        n = min(h, SPITFIRE_BAND_LINES);
+        if (pdrv->SavedAccelCmd & SPITFIRE_DEC_Y) {
+            SpitfireXAACopyRect(pdrv, x1, y1 + h - n, x2, y2 + h - n, w, n, bpp);
+        } else {
+            SpitfireXAACopyRect(pdrv, x1, y1, x2, y2, w, n, bpp);
+            y1 += n;
+            y2 += n;
+        }
+    }
+}
+
+static void SpitfireSetupForSolidFill(
+    ScrnInfoPtr pScrn,
+    int color, 
+    int rop,
+    unsigned int planemask)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    unsigned int cmd;
+    int seedY;
+
+    SpitfireCpuSetup(pdrv, rop, planemask, color, -1);
+    if (pdrv->EngineFailed)
+        return;
+
+    cmd = SPITFIRE_CMD_FILL
+        | SPITFIRE_PAT_FOREGROUND
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_FGCOLOR /* <-- Use foreground color, not pixmap, as source */
+        | SPITFIRE_BACK_SRC_BGCOLOR;/* <-- Use background color, not pixmap, as source */
+
+    pdrv->Accel.SeedFill = pdrv->Bpp == 3
+        && ((color & 0xFF) != ((color >> 8) & 0xFF)
+            || (color & 0xFF) != ((color >> 16) & 0xFF));
+
+    if (pdrv->Accel.SeedFill) {
+        /* The seed row is in the framebuffer, below the offscreen memory */
+        SpitfireXAAPlanemask(pdrv, planemask);
+        SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+        SpitfireSetRopMix(pdrv, 0xCC); /* GXcopy */
+        seedY = pdrv->SeedLine - SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_A,
+                                                pdrv->SeedLine, pdrv->SeedLine);
+        SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_C,
+                       pdrv->SeedLine, pdrv->SeedLine);
+        SpitfireSeedRow(pdrv, pdrv->FBBase + pdrv->SeedLine * pdrv->lDelta,
+            SPITFIRE_SRC_PIXMAP_A | SPITFIRE_DST_PIXMAP_C, 0, seedY, color);
+        SpitfireSetRopMix(pdrv, XAAGetCopyROP(rop));
+
+        pdrv->Accel.FillColor = color;
+        pdrv->Accel.FillCopy = (rop == GXcopy);
+        pdrv->Accel.FillCpu = (rop == GXcopy);
+        return;
+    }
+
+    SpitfireSetColors(pdrv, color, color);
+    SpitfireXAAPlanemask(pdrv, planemask);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, XAAGetCopyROP(rop));
+
+    /* The destination pixmap is set up for each rectangle */
+    pdrv->SavedAccelCmd = cmd;
+}
+
+static inline void SpitfireXAAFillRect(
+    SpitfirePtr pdrv,
+    int x,
+    int y,
+    int w,
+    int h,
+    const int bpp)
+{
+    int band = SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_C, y, y + h - 1);
+    CARD32 cmd = pdrv->SavedAccelCmd;
+
+    y -= band;
+
+    /* On 24bpp, we are pretending to work at 8bpp, so triple all dimensions */
+    if (bpp == 24) {
+        if (pdrv->Accel.SeedFill) {
+            int seedY = pdrv->SeedLine - SpitfireFbBand(pdrv,
+                SPITFIRE_INDEX_PIXMAP_A, pdrv->SeedLine, pdrv->SeedLine);
+
+            SpitfireSeedFill(pdrv, pdrv->FBBase + band * pdrv->lDelta,
+                             pdrv->lDelta, x, y, w, h, 0, seedY);
+            return;
+        }
+        x *= 3; w *= 3;
+        if (pdrv->Accel.Wide) {
+            SpitfireWideBlit(pdrv, cmd, x, y, x, y, w, h);
+            return;
+        }
+    }
+    if (!SpitfireXAAScissor(pdrv, band, &cmd))
+        return;
+
+    /* Wait for room in the coprocessor command buffer */
+    SpitfireWaitCmdSlot(pdrv);
+
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, w - 1, h - 1);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, x, y);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x, y);
+
+    SpitfireKickCmd(pdrv, cmd);
+}
+
+static inline void SpitfireSubsequentSolidFillRectTmpl(
+    ScrnInfoPtr pScrn,
+    int x,
+    int y,
+    int w,
+    int h,
+    const int bpp)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    int n;
+
+    if (pdrv->EngineFailed) {
+        SpitfireCpuFill(pdrv, x, y, w, h);
+        return;
+    }
+
+    /* Past line 4095, fill in strips that each fit a band */
+    for (; h > 0; h -= n, y += n) {
+        n = (y + h <= 0x1000) ? h : min(h, SPITFIRE_BAND_LINES);
+        SpitfireXAAFillRect(pdrv, x, y, w, n, bpp);
+    }
+}
+
+static void SpitfireSetupForMono8x8PatternFill(
+	ScrnInfoPtr pScrn,
+	int patx, int paty,
+	int fg, int bg,
+	int rop,
+	unsigned int planemask)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    unsigned int cmd;
+    CARD32 patoffset;
+
+    patoffset = (pdrv->cxMemory * paty + patx) * pdrv->Bpp;
+    SpitfireCpuSetup(pdrv, rop, planemask, fg, bg);
+    memcpy(pdrv->Accel.CpuMono, pdrv->FBBase + patoffset, 8);
+    if (pdrv->EngineFailed)
+        return;
+
+    cmd = SPITFIRE_CMD_BITBLT
+        | SPITFIRE_SRC_PIXMAP_A
+        | SPITFIRE_PAT_PIXMAP_B
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_FGCOLOR /* <-- Use foreground color, not pixmap, as source */
+        | ((bg != -1) 
+            ? SPITFIRE_BACK_SRC_BGCOLOR /* <-- Use background color, not pixmap, as source */
+            : SPITFIRE_BACK_SRC_PIXMAP) /* <-- Use source pixmap, so should be a noop */
+        ;
+
+    SpitfireSetColors(pdrv, fg, bg);
+    SpitfireXAAPlanemask(pdrv, planemask);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, XAAGetCopyROP(rop));
+
+    /* Set up pattern pixmap, source and destination are set up for each
+       rectangle */
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_B,
+        patoffset, 8 - 1, 8 - 1, 
+        SPITFIRE_FORMAT_1BPP | SPITFIRE_FORMAT_INTEL);
+    pdrv->SavedAccelCmd = cmd;
+}
+
+static void SpitfireSubsequentMono8x8PatternFillRect(
+	ScrnInfoPtr pScrn,
+	int patx, int paty,
+	int x, int y, int w, int h)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    CARD32 cmd;
+    int band, n;
+
+    if (pdrv->EngineFailed) {
+        SpitfireCpuMonoFill(pdrv, patx, paty, x, y, w, h);
+        return;
+    }
+
+    /* Past line 4095, fill in strips that each fit a band. Strips are whole
+       repeats of the pattern, so it stays in phase. */
+    for (; h > 0; h -= n, y += n) {
+        n = (y + h <= 0x1000) ? h : min(h, SPITFIRE_BAND_LINES);
+        cmd = pdrv->SavedAccelCmd;
+
+        /* The source is read only to leave the background alone, so it is 
+           the destination itself */
+        band = SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_A, y, y + n - 1);
+        SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_C, y, y + n - 1);
+        if (!SpitfireXAAScissor(pdrv, band, &cmd))
+            continue;
+
+        /* Wait for room in the coprocessor command buffer */
+        SpitfireWaitCmdSlot(pdrv);
+
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, w - 1, n - 1);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, x, y - band);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_PAT, patx, paty);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x, y - band);
+
+        SpitfireKickCmd(pdrv, cmd);
+    }
+}
+
+/* Find the tile for a mono pattern with its colors, expanding it into the
+   least recently used entry if there is none yet. The CPU writes one repeat
+   of the pattern, which the engine widens by doubling. Returns the index of
+   the entry. */
+static int
+SpitfireMonoTileLookup(SpitfirePtr pdrv, CARD32 pat0, CARD32 pat1, int fg, int bg)
+{
+    SpitfireMonoTilePtr entry, victim = NULL;
+    CARD32 offset;
+    unsigned char *tile;
+    int i, x, y, n, lines, index;
+
+    for (i = 0; i < SPITFIRE_MONO_TILES; i++) {
+        entry = &pdrv->MonoTiles[i];
+        if (entry->valid && entry->pat0 == pat0 && entry->pat1 == pat1
+            && entry->fg == fg && entry->bg == bg) {
+            entry->lastUse = ++pdrv->MonoTileUses;
+            return i;
+        }
+        if (!victim || (victim->valid && (!entry->valid
+                        || (INT32)(entry->lastUse - victim->lastUse) < 0)))
+            victim = entry;
+    }
+
+    index = victim - pdrv->MonoTiles;
+    offset = pdrv->MonoTileOffset
+        + index * SPITFIRE_MONO_TILE_PITCH * SPITFIRE_MONO_TILE_LINES * 2;
+    tile = pdrv->FBBase + offset;
+    lines = SPITFIRE_MONO_TILE_LINES * ((bg == -1) ? 2 : 1);
+
+    /* Earlier fills may still be reading it */
+    SpitfireWaitSeq(pdrv, victim->seq);
+
+    /* A transparent pattern gets a mask tile, which clears the pixels the
+       pattern sets, above a color tile with fg there and nothing elsewhere */
+    for (y = 0; y < lines; y++) {
+        CARD32 row = ((y & 7) < 4 ? pat0 >> ((y & 3) * 8) : pat1 >> ((y & 3) * 8));
+        unsigned char *p = tile + y * SPITFIRE_MONO_TILE_PITCH;
+
+        for (x = 0; x < 8; x++, p += 3) {
+            CARD32 color;
+
+            if (bg != -1)
+                color = (row & (1 << x)) ? fg : bg;
+            else if (y < SPITFIRE_MONO_TILE_LINES)
+                color = (row & (1 << x)) ? 0 : 0xFFFFFF;
+            else
+                color = (row & (1 << x)) ? fg : 0;
+            p[0] = color;
+            p[1] = color >> 8;
+            p[2] = color >> 16;
+        }
+    }
+
+    SpitfireSetPixelBitmask(pdrv, ~0);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, 0xCC); /* GXcopy */
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_A, offset,
+        SPITFIRE_MONO_TILE_PITCH - 1, SPITFIRE_MONO_TILE_LINES * 2 - 1,
+        SPITFIRE_FORMAT_8BPP);
+    for (n = 8 * 3; n < SPITFIRE_MONO_TILE_PITCH; n *= 2) {
+        SpitfireWaitCmdSlot(pdrv);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1,
+                             min(n, SPITFIRE_MONO_TILE_PITCH - n) - 1, lines - 1);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, 0, 0);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, n, 0);
+        SpitfireKickCmd(pdrv, SPITFIRE_CMD_BITBLT
+            | SPITFIRE_SRC_PIXMAP_A
+            | SPITFIRE_PAT_FOREGROUND
+            | SPITFIRE_DST_PIXMAP_A
+            | SPITFIRE_FORE_SRC_PIXMAP
+            | SPITFIRE_BACK_SRC_PIXMAP);
+    }
+
+    victim->pat0 = pat0;
+    victim->pat1 = pat1;
+    victim->fg = fg;
+    victim->bg = bg;
+    victim->valid = TRUE;
+    victim->seq = pdrv->SubmitSeq;
+    victim->lastUse = ++pdrv->MonoTileUses;
+    return index;
+}
+
+/* Mono pattern fills at 24bpp, from a color tile in pixmap A. XAA passes the
+   pattern bits, as BIT_ORDER_IN_BYTE_LSBFIRST rows of a byte each. */
+static void SpitfireSetupForMono8x8PatternTile(
+    ScrnInfoPtr pScrn,
+    int patx, int paty,
+    int fg, int bg,
+    int rop,
+    unsigned int planemask)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    int i;
+
+    if (bg != -1)
+        bg &= 0xFFFFFF;
+    SpitfireCpuSetup(pdrv, rop, planemask, fg & 0xFFFFFF, bg);
+    for (i = 0; i < 8; i++)
+        pdrv->Accel.CpuMono[i] = (CARD32)((i < 4) ? patx : paty) >> ((i & 3) * 8);
+    if (pdrv->EngineFailed)
+        return;
+
+    pdrv->Accel.MonoTile = SpitfireMonoTileLookup(pdrv, patx, paty,
+                                                  fg & 0xFFFFFF, bg);
+    pdrv->Accel.MonoCopy = (rop == GXcopy);
+
+    /* Transparent fills are always GXcopy, done as two passes with ROPs of
+       their own */
+    SpitfireXAAPlanemask(pdrv, planemask);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, XAAGetCopyROP(rop));
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_A, pdrv->MonoTileOffset
+        + pdrv->Accel.MonoTile * SPITFIRE_MONO_TILE_PITCH * SPITFIRE_MONO_TILE_LINES * 2,
+        SPITFIRE_MONO_TILE_PITCH - 1, SPITFIRE_MONO_TILE_LINES * 2 - 1,
+        SPITFIRE_FORMAT_8BPP);
+}
+
+/* Copy w by h pixels of the tile starting at line tileY of pixmap A to (x, y)
+   of pixmap C, with (patx, paty) of the pattern at the top left. With 
+   doubling, only the first 8 lines come from the tile, the others are copied
+   from those already drawn. */
+static void
+SpitfireMonoTileBlit(SpitfirePtr pdrv, int tileY, int patx, int paty,
+                     int x, int y, int w, int h, Bool doubling)
+{
+    /* Widest copy from the tile, whatever pixel of the pattern it starts on */
+    const int span = SPITFIRE_MONO_TILE_PITCH / 3 - 7;
+    int rows = doubling ? min(h, 8) : h;
+    int i, j, n, m;
+
+    for (i = 0; i < w; i += n) {
+        n = min(w - i, span);
+        for (j = 0; j < rows; j += m) {
+            m = min(rows - j, 8);
+            SpitfireWaitCmdSlot(pdrv);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, n * 3 - 1, m - 1);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC,
+                                 ((patx + i) & 7) * 3, tileY + ((paty + j) & 7));
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, (x + i) * 3, y + j);
+            SpitfireKickCmd(pdrv, SPITFIRE_CMD_BITBLT
+                | SPITFIRE_SRC_PIXMAP_A
+                | SPITFIRE_PAT_FOREGROUND
+                | SPITFIRE_DST_PIXMAP_C
+                | SPITFIRE_FORE_SRC_PIXMAP
+                | SPITFIRE_BACK_SRC_PIXMAP);
+        }
+    }
+
+    /* Whole repeats of the pattern, so the lines stay in step with it */
+    for (j = rows; j < h; j += m) {
+        m = min(j, h - j);
+        SpitfireWaitCmdSlot(pdrv);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, w * 3 - 1, m - 1);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, x * 3, y);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x * 3, y + j);
+        SpitfireKickCmd(pdrv, SPITFIRE_CMD_BITBLT
+            | SPITFIRE_SRC_PIXMAP_C
+            | SPITFIRE_PAT_FOREGROUND
+            | SPITFIRE_DST_PIXMAP_C
+            | SPITFIRE_FORE_SRC_PIXMAP
+            | SPITFIRE_BACK_SRC_PIXMAP);
+    }
+}
+
+static void SpitfireSubsequentMono8x8PatternTileRect(
+    ScrnInfoPtr pScrn,
+    int patx, int paty,
+    int x, int y, int w, int h)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    SpitfireMonoTilePtr tile = &pdrv->MonoTiles[pdrv->Accel.MonoTile];
+    int band, n;
+
+    if (pdrv->EngineFailed) {
+        SpitfireCpuMonoFill(pdrv, patx, paty, x, y, w, h);
+        return;
+    }
+
+    /* Past line 4095, fill in strips that each fit a band. Strips are whole
+       repeats of the pattern, so it stays in phase. */
+    for (; h > 0; h -= n, y += n) {
+        n = (y + h <= 0x1000) ? h : min(h, SPITFIRE_BAND_LINES);
+        band = SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_C, y, y + n - 1);
+
+        if (tile->bg == -1) {
+            SpitfireSetRopMix(pdrv, 0x88); /* Clear where the pattern is set */
+            SpitfireMonoTileBlit(pdrv, 0, patx, paty, x, y - band, w, n, FALSE);
+            SpitfireSetRopMix(pdrv, 0xEE); /* ... and paint it there */
+            SpitfireMonoTileBlit(pdrv, SPITFIRE_MONO_TILE_LINES, patx, paty,
+                                 x, y - band, w, n, FALSE);
+        } else {
+            SpitfireMonoTileBlit(pdrv, 0, patx, paty, x, y - band, w, n,
+                                 pdrv->Accel.MonoCopy);
+        }
+    }
+    tile->seq = pdrv->SubmitSeq;
+}
+
+static void SpitfireSetupForColor8x8PatternFill(
+    ScrnInfoPtr pScrn,
+    int patx, int paty,
+    int rop,
+    unsigned int planemask,
+    int trans_color)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    unsigned int cmd;
+
+    SpitfireCpuSetup(pdrv, rop, planemask, 0, -1);
+    pdrv->Accel.CpuTrans = trans_color;
+    pdrv->Accel.CpuPatX = patx;
+    pdrv->Accel.CpuPatY = paty;
+    if (pdrv->EngineFailed)
+        return;
+
+    /* Pack the pattern from the pixmap cache into the scratch area, with
+       every plane */
+    SpitfireSetPixelBitmask(pdrv, ~0);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, 0xCC); /* GXcopy */
+    paty -= SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_A, paty, paty + 8 - 1);
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_C, 
+        pdrv->PatternOffset, 8 - 1, 8 - 1, pdrv->Accel.FbFormat);
+
+    SpitfireWaitCmdSlot(pdrv);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, 8 - 1, 8 - 1);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, patx, paty);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, 0, 0);
+    SpitfireKickCmd(pdrv, SPITFIRE_CMD_BITBLT
+        | SPITFIRE_SRC_PIXMAP_A
+        | SPITFIRE_PAT_FOREGROUND
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_PIXMAP
+        | SPITFIRE_BACK_SRC_PIXMAP);
+
+    /* The packed pattern is both source and pattern of the fill */
+    cmd = SPITFIRE_CMD_PATTERN_COPY
+        | SPITFIRE_SRC_PIXMAP_B
+        | SPITFIRE_PAT_PIXMAP_B
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_PIXMAP
+        | SPITFIRE_BACK_SRC_PIXMAP;
+
+    SpitfireXAAPlanemask(pdrv, planemask);
+    if (trans_color != -1) {
+        SpitfireSetColorCompare(pdrv, trans_color, 2); /* Update on != trans_color */
+    }
+    SpitfireSetRopMix(pdrv, XAAGetCopyROP(rop));
+
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_B,
+        pdrv->PatternOffset, 8 - 1, 8 - 1, pdrv->Accel.FbFormat);
+    pdrv->SavedAccelCmd = cmd;
+}
+
+static void SpitfireSubsequentColor8x8PatternFillRect(
+    ScrnInfoPtr pScrn,
+    int patx, int paty,
+    int x, int y, int w, int h)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    CARD32 cmd;
+    int band, n;
+
+    if (pdrv->EngineFailed) {
+        SpitfireCpuColorFill(pdrv, patx, paty, x, y, w, h);
+        return;
+    }
+
+    /* Past line 4095, fill in strips that each fit a band. Strips are whole
+       repeats of the pattern, so it stays in phase. */
+    for (; h > 0; h -= n, y += n) {
+        n = (y + h <= 0x1000) ? h : min(h, SPITFIRE_BAND_LINES);
+        cmd = pdrv->SavedAccelCmd;
+
+        band = SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_C, y, y + n - 1);
+        if (!SpitfireXAAScissor(pdrv, band, &cmd))
+            continue;
+
+        /* Wait for room in the coprocessor command buffer */
+        SpitfireWaitCmdSlot(pdrv);
+
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, w - 1, n - 1);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, patx, paty);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_PAT, patx, paty);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x, y - band);
+
+        SpitfireKickCmd(pdrv, cmd);
+    }
+}
+
+static void SpitfireSetupForSolidLine(
+    ScrnInfoPtr pScrn,
+    int color,
+    int rop,
+    unsigned int planemask)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    unsigned int cmd;
+
+    SpitfireCpuSetup(pdrv, rop, planemask, color, -1);
+    if (pdrv->EngineFailed)
+        return;
+
+    cmd = SPITFIRE_CMD_LINE_DRAW_WRITE
+        | SPITFIRE_PAT_FOREGROUND
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_FGCOLOR
+        | SPITFIRE_BACK_SRC_BGCOLOR;
+
+    SpitfireSetColors(pdrv, color, color);
+    SpitfireXAAPlanemask(pdrv, planemask);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, XAAGetCopyROP(rop));
+
+    /* The destination pixmap is set up for each line */
+    pdrv->SavedAccelCmd = cmd;
+}
+
+/* Horizontal and vertical lines are filled as rectangles one pixel thick,
+   which the engine writes faster than it steps along a line */
+static void SpitfireSubsequentSolidHorVertLine(
+    ScrnInfoPtr pScrn,
+    int x, int y, int len, int dir)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    CARD32 cmd;
+    int w = 1, h = 1;
+    int band, n;
+
+    if (dir == DEGREES_0)
+        w = len;
+    else
+        h = len;
+
+    if (pdrv->EngineFailed) {
+        SpitfireCpuFill(pdrv, x, y, w, h);
+        return;
+    }
+
+    /* Past line 4095, fill in strips that each fit a band */
+    for (; h > 0; h -= n, y += n) {
+        n = (y + h <= 0x1000) ? h : min(h, SPITFIRE_BAND_LINES);
+        cmd = (pdrv->SavedAccelCmd & ~SPITFIRE_CMD_OPCODE_MASK) 
+            | SPITFIRE_CMD_FILL;
+
+        band = SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_C, y, y + n - 1);
+        if (!SpitfireXAAScissor(pdrv, band, &cmd))
+            continue;
+
+        /* Wait for room in the coprocessor command buffer */
+        SpitfireWaitCmdSlot(pdrv);
+
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, w - 1, n - 1);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, x, y - band);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x, y - band);
+
+        SpitfireKickCmd(pdrv, cmd);
+    }
+}
+
+/* XAA passes the terms of the line already doubled, as fb's e1 and -e3, and
+   the error term before it is adjusted to compare against zero, as fb's e */
+static void SpitfireSubsequentSolidBresenhamLine(
+    ScrnInfoPtr pScrn,
+    int x, int y, int absmaj, int absmin, int err, int len, int octant)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    CARD32 cmd;
+    int e = err - absmin, e1 = absmin, e3 = -absmaj;
+    int band, n, i;
+
+    if (pdrv->EngineFailed) {
+        SpitfireCpuLine(pdrv, x, y, e, e1, e3, len, octant);
+        return;
+    }
+
+    /* Lines spanning more rows than a band holds are drawn in pieces */
+    for (; len > 0; len -= n) {
+        n = min(len, SPITFIRE_LINE_ROWS + 1);
+        cmd = pdrv->SavedAccelCmd | SpitfireLineOctant(octant);
+
+        if (octant & YDECREASING)
+            band = SpitfireFbLineBand(pdrv, max(y - n + 1, 0), y);
+        else
+            band = SpitfireFbLineBand(pdrv, y, y + n - 1);
+        if (SpitfireXAAScissor(pdrv, band, &cmd))
+            SpitfireSubmitLine(pdrv, cmd, x, y - band, e, e1, e3, n);
+        if (n == len)
+            break;
+
+        /* Step past the pixels drawn, as the engine does */
+        for (i = 0; i < n; i++) {
+            e += e1;
+            if (e >= 0) {
+                e += e3;
+                if (octant & YMAJOR)
+                    x += (octant & XDECREASING) ? -1 : 1;
+                else
+                    y += (octant & YDECREASING) ? -1 : 1;
+            }
+            if (octant & YMAJOR)
+                y += (octant & YDECREASING) ? -1 : 1;
+            else
+                x += (octant & XDECREASING) ? -1 : 1;
+        }
+    }
+}
+
+/* XAA only hands over lines here that need no clipping, other than by the
+   clipping rectangle */
+static void SpitfireSubsequentSolidTwoPointLine(
+    ScrnInfoPtr pScrn,
+    int x1, int y1, int x2, int y2, int flags)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    CARD32 cmd;
+    BoxRec box;
+    int band, bottom = max(y1, y2);
+
+    if (pdrv->EngineFailed) {
+        int adx, ady, e, e1, e3, len, octant;
+
+        len = SpitfireLineTerms(x1, y1, x2, y2,
+                                miGetZeroLineBias(xf86ScrnToScreen(pScrn)),
+                                &adx, &ady, &e, &e1, &e3, &octant);
+        if (!(flags & OMIT_LAST))
+            len++;
+        SpitfireCpuLine(pdrv, x1, y1, e, e1, e3, len, octant);
+        return;
+    }
+
+    /* Lines spanning more rows than a band holds are clipped into pieces */
+    box.x1 = 0;
+    box.x2 = pdrv->cxMemory;
+    for (box.y1 = min(y1, y2); box.y1 <= bottom; box.y1 = box.y2) {
+        box.y2 = min(box.y1 + SPITFIRE_LINE_ROWS, bottom) + 1;
+        cmd = pdrv->SavedAccelCmd;
+
+        band = SpitfireFbLineBand(pdrv, box.y1, box.y2 - 1);
+        if (!SpitfireXAAScissor(pdrv, band, &cmd))
+            continue;
+
+        SpitfireClipLine(pdrv, cmd, x1, y1, x2, y2,
+                         !(flags & OMIT_LAST),
+                         miGetZeroLineBias(xf86ScrnToScreen(pScrn)),
+                         &box, 1, 0, -band);
+    }
+}
+
+static void SpitfireSetupForScanlineCPUToScreenColorExpandFill(
+    ScrnInfoPtr pScrn,
+    int fg, int bg,
+    int rop,
+    unsigned int planemask)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    unsigned int cmd;
+
+    SpitfireCpuSetup(pdrv, rop, planemask, fg, bg);
+    if (pdrv->EngineFailed)
+        return;
+
+    cmd = SPITFIRE_CMD_TEXT_BITBLT
+        | SPITFIRE_SRC_PIXMAP_A
+        | SPITFIRE_PAT_PIXMAP_B
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_FGCOLOR /* <-- Use foreground color, not pixmap, as source */
+        | ((bg != -1) 
+            ? SPITFIRE_BACK_SRC_BGCOLOR /* <-- Use background color, not pixmap, as source */
+            : SPITFIRE_BACK_SRC_PIXMAP) /* <-- Use source pixmap, so should be a noop */
+        ;
+
+    SpitfireSetColors(pdrv, fg, bg);
+    SpitfireXAAPlanemask(pdrv, planemask);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, XAAGetCopyROP(rop));
+
+    /* The scanline buffers, one per row of the bitmap. Source and
+       destination are the framebuffer, set up for each scanline. */
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_B,
+        pdrv->ScanlineOffset, SPITFIRE_SCANLINE_PITCH * 8 - 1,
+        SPITFIRE_SCANLINE_BUFFERS - 1,
+        SPITFIRE_FORMAT_1BPP | SPITFIRE_FORMAT_INTEL);
+    pdrv->SavedAccelCmd = cmd;
+}
+
+static void SpitfireSubsequentScanlineCPUToScreenColorExpandFill(
+    ScrnInfoPtr pScrn,
+    int x, int y, int w, int h,
+    int skipleft)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    pdrv->Accel.ExpandX = x;
+    pdrv->Accel.ExpandY = y;
+    pdrv->Accel.ExpandW = w;
+    pdrv->Accel.ExpandSkip = skipleft;
+
+    /* XAA starts writing into the first buffer as soon as this returns */
+    SpitfireWaitSeq(pdrv, pdrv->ScanlineSeq[0]);
+}
+
+static void SpitfireSubsequentColorExpandScanline(
+    ScrnInfoPtr pScrn,
+    int bufno)
+{
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    int x = pdrv->Accel.ExpandX;
+    int y = pdrv->Accel.ExpandY++;
+
+    if (pdrv->EngineFailed) {
+        unsigned char *bits = pdrv->ScanlineBuffers[bufno];
+        int i, bit;
+
+        for (i = 0; i < pdrv->Accel.ExpandW; i++) {
+            bit = pdrv->Accel.ExpandSkip + i;
+            if (bits[bit >> 3] & (1 << (bit & 7)))
+                SpitfireCpuPixel(pdrv, x + i, y, pdrv->Accel.CpuFg);
+            else if (pdrv->Accel.CpuBg != -1)
+                SpitfireCpuPixel(pdrv, x + i, y, pdrv->Accel.CpuBg);
+        }
+        return;
+    }
+
+    SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_C, y, y);
+    y -= SpitfireFbBand(pdrv, SPITFIRE_INDEX_PIXMAP_A, y, y);
+
+    /* Wait for room in the coprocessor command buffer */
+    SpitfireWaitCmdSlot(pdrv);
+
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, pdrv->Accel.ExpandW - 1, 0);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, x, y);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_PAT, pdrv->Accel.ExpandSkip, bufno);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x, y);
+
+    SpitfireKickCmd(pdrv, pdrv->SavedAccelCmd);
+    pdrv->ScanlineSeq[bufno] = pdrv->SubmitSeq;
+
+    /* XAA fills the next buffer as soon as this returns */
+    SpitfireWaitSeq(pdrv, 
+        pdrv->ScanlineSeq[(bufno + 1) % SPITFIRE_SCANLINE_BUFFERS]);
+}
+
+#define SPITFIRE_XAA_BPP_FUNCS(bpp)                                         \
+static void SpitfireSubsequentScreenToScreenCopy##bpp(ScrnInfoPtr pScrn,   \
+    int x1, int y1, int x2, int y2, int w, int h)                           \
+{                                                                           \
+    SpitfireSubsequentScreenToScreenCopyTmpl(pScrn, x1, y1, x2, y2, w, h, bpp); \
+}                                                                           \
+static void SpitfireSubsequentSolidFillRect##bpp(ScrnInfoPtr pScrn,        \
+    int x, int y, int w, int h)                                             \
+{                                                                           \
+    SpitfireSubsequentSolidFillRectTmpl(pScrn, x, y, w, h, bpp);            \
+}
+
+SPITFIRE_XAA_BPP_FUNCS(8)
+SPITFIRE_XAA_BPP_FUNCS(16)
+SPITFIRE_XAA_BPP_FUNCS(24)
+SPITFIRE_XAA_BPP_FUNCS(32)
+
+/* Install the per-rectangle functions that match the depth of the screen, 
+   for the operations that SpitfireXAAInit decided to accelerate */
+static void SpitfireXAAInstallBppFuncs(XAAInfoRecPtr xaaptr, int bpp)
+{
+    void (*copy)(ScrnInfoPtr, int, int, int, int, int, int) = NULL;
+    void (*fill)(ScrnInfoPtr, int, int, int, int) = NULL;
+
+    switch (bpp) {
+    case 8:
+        copy = SpitfireSubsequentScreenToScreenCopy8;
+        fill = SpitfireSubsequentSolidFillRect8;
+        break;
+    case 16:
+        copy = SpitfireSubsequentScreenToScreenCopy16;
+        fill = SpitfireSubsequentSolidFillRect16;
+        break;
+    case 24:
+        copy = SpitfireSubsequentScreenToScreenCopy24;
+        fill = SpitfireSubsequentSolidFillRect24;
+        break;
+    case 32:
+        copy = SpitfireSubsequentScreenToScreenCopy32;
+        fill = SpitfireSubsequentSolidFillRect32;
+        break;
+    }
+
+    if (xaaptr->SetupForScreenToScreenCopy)
+        xaaptr->SubsequentScreenToScreenCopy = copy;
+    if (xaaptr->SetupForSolidFill)
+        xaaptr->SubsequentSolidFillRect = fill;
+}
+#endif
+
+static Bool
+SpitfirePrepareSolid(PixmapPtr pPixmap, int alu, Pixel planemask, Pixel fg);
+
+static void
+SpitfireDoneSolid(PixmapPtr pPixmap);
+
+static Bool
+SpitfirePrepareCopy(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap, int xdir, int ydir,
+					int alu, Pixel planemask);
+
+static void
+SpitfireDoneCopy(PixmapPtr pDstPixmap);
+
+#ifdef RENDER
+static Bool
+SpitfireCheckComposite(int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
+                       PicturePtr pDstPicture);
+
+static Bool
+SpitfirePrepareComposite(int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
+                         PicturePtr pDstPicture, PixmapPtr pSrc, PixmapPtr pMask,
+                         PixmapPtr pDst);
+
+static void
+SpitfireCompositeRect(PixmapPtr pDst, int srcX, int srcY, int maskX, int maskY,
+                      int dstX, int dstY, int w, int h);
+
+static void
+SpitfireDoneComposite(PixmapPtr pDst);
+#endif
+
+static void
+SpitfireEXAInstallBppFuncs(ExaDriverPtr exaptr, int bpp);
+
+static Bool
+SpitfireDownloadFromScreen(PixmapPtr pSrc, int x, int y, int w, int h,
+                           char *dst, int dst_pitch);
+
+static Bool
+SpitfireCreateGC(GCPtr pGC);
+static Bool
+SpitfireUnrealizeFont(ScreenPtr pScreen, FontPtr pFont);
+static Bool
+SpitfireDestroyPixmap(PixmapPtr pPixmap);
+#ifdef SPITFIRE_MASKED_COPY
+static void
+SpitfireComposite(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+                  INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask,
+                  INT16 xDst, INT16 yDst, CARD16 width, CARD16 height);
+#endif
+
+
+
+/* EXA has no hooks for lines, core text or patterned fills, so those are
+   accelerated by wrapping the ops of GCs that draw them. Every other op goes
+   straight to the layer below. */
+typedef struct {
+    const GCFuncs *wrapFuncs;
+    const GCOps *wrapOps;   /* NULL while the GC does not qualify */
+    GCOps ops;              /* wrapOps, with our ops in place */
+    Bool drawLines;         /* Polylines and PolySegment are replaced */
+    Bool drawText;          /* PolyGlyphBlt and ImageGlyphBlt are replaced */
+    Bool drawFill;          /* PolyFillRect is replaced */
+} SpitfireGCPrivRec, *SpitfireGCPrivPtr;
+
+static DevPrivateKeyRec SpitfireGCPrivateKeyRec;
+#define SpitfireGetGCPriv(pGC) ((SpitfireGCPrivPtr) \
+    dixGetPrivateAddr(&(pGC)->devPrivates, &SpitfireGCPrivateKeyRec))
+
+/* Core text is drawn from a glyph atlas: a 1bpp pixmap in video memory, 4096
+   pixels wide and cut into square slots, each holding one glyph. Glyphs are
+   uploaded by the CPU the first time they are drawn and stay until their slot
+   is the least recently used one and is needed for another glyph, or their
+   font goes away. The first row of slots is kept blank, so that the 
+   background of image text can be expanded from it. */
+#define SPITFIRE_GLYPH_SIZE         32      /* Largest glyph cached, in pixels */
+#define SPITFIRE_GLYPH_PITCH        512     /* Bytes per line of the atlas */
+#define SPITFIRE_GLYPH_ROWS         16      /* Rows of slots, the first blank */
+#define SPITFIRE_GLYPH_PER_ROW      (SPITFIRE_GLYPH_PITCH * 8 / SPITFIRE_GLYPH_SIZE)
+#define SPITFIRE_GLYPH_SLOTS        ((SPITFIRE_GLYPH_ROWS - 1) * SPITFIRE_GLYPH_PER_ROW)
+#define SPITFIRE_GLYPH_ATLAS_SIZE   (SPITFIRE_GLYPH_ROWS * SPITFIRE_GLYPH_SIZE \
+                                     * SPITFIRE_GLYPH_PITCH)
+#define SPITFIRE_GLYPH_HASH_SIZE    1024
+
+typedef struct {
+    FontPtr pFont;
+    CharInfoPtr pci;    /* NULL while the slot is free */
+    int hashNext;       /* Next slot in the same hash bucket, or -1 */
+    int lruPrev;        /* Neighbours in order of use */
+    int lruNext;
+    CARD32 seq;         /* Last submission that read the slot */
+} SpitfireGlyphSlotRec, *SpitfireGlyphSlotPtr;
+
+typedef struct _SpitfireGlyphCache {
+    int hash[SPITFIRE_GLYPH_HASH_SIZE];
+    /* The extra slot heads the use list, most recently used first */
+    SpitfireGlyphSlotRec slots[SPITFIRE_GLYPH_SLOTS + 1];
+} SpitfireGlyphCacheRec, *SpitfireGlyphCachePtr;
+
+#define SPITFIRE_GLYPH_LRU_HEAD     SPITFIRE_GLYPH_SLOTS
+
+#define SpitfireGlyphHash(pci) \
+    (((unsigned long)(pci) / sizeof(CharInfoRec)) & (SPITFIRE_GLYPH_HASH_SIZE - 1))
+
+/* Per-pixmap record of the last engine submissions that touched the pixmap */
+typedef struct {
+    CARD32 WriteSeq;    /* Last submission that wrote to the pixmap */
+    CARD32 UseSeq;      /* Last submission that read or wrote the pixmap */
+} SpitfirePixmapPrivRec, *SpitfirePixmapPrivPtr;
+
+static DevPrivateKeyRec SpitfirePixmapPrivateKeyRec;
+#define SpitfireGetPixmapPriv(pPix) ((SpitfirePixmapPrivPtr) \
+    dixGetPrivateAddr(&(pPix)->devPrivates, &SpitfirePixmapPrivateKeyRec))
+
+/* Record that every command submitted so far may have touched the pixmap */
+static void SpitfireMarkPixmap(SpitfirePtr pdrv, PixmapPtr pPixmap, Bool written)
+{
+    SpitfirePixmapPrivPtr priv = SpitfireGetPixmapPriv(pPixmap);
+
+    priv->UseSeq = pdrv->SubmitSeq;
+    if (written)
+        priv->WriteSeq = pdrv->SubmitSeq;
+}
+
+/* Video memory is being handed back to EXA while commands up to seq may still
+   use it. The sequence numbers of its next owner start out empty, so CPU
+   access to that must wait for these commands instead. */
+static void SpitfireFreeSeq(SpitfirePtr pdrv, CARD32 seq)
+{
+    if ((INT32)(seq - pdrv->FreedSeq) > 0)
+        pdrv->FreedSeq = seq;
+}
+
+/* The submission that CPU access to the pixmap has to wait for, if writing
+   or only reading it. A pixmap only covers its memory from its own first
+   submission on, before that whatever was freed last may still be there. */
+static CARD32 SpitfirePixmapSeq(SpitfirePtr pdrv, PixmapPtr pPixmap, Bool write)
+{
+    SpitfirePixmapPrivPtr priv = SpitfireGetPixmapPriv(pPixmap);
+    CARD32 seq = write ? priv->UseSeq : priv->WriteSeq;
+
+    if (!priv->UseSeq || (INT32)(pdrv->FreedSeq - seq) > 0)
+        return pdrv->FreedSeq;
+    return seq;
+}
+
+static Bool
+SpitfireDestroyPixmap(PixmapPtr pPixmap)
+{
+    ScreenPtr pScreen = pPixmap->drawable.pScreen;
+    SpitfirePtr pdrv = DEVPTR(xf86ScreenToScrn(pScreen));
+    SpitfirePixmapPrivPtr priv = SpitfireGetPixmapPriv(pPixmap);
+    Bool ret;
+
+    if (pPixmap->refcnt == 1 && priv->UseSeq)
+        SpitfireFreeSeq(pdrv, priv->UseSeq);
+
+    pScreen->DestroyPixmap = pdrv->DestroyPixmap;
+    ret = (*pScreen->DestroyPixmap)(pPixmap);
+    pdrv->DestroyPixmap = pScreen->DestroyPixmap;
+    pScreen->DestroyPixmap = SpitfireDestroyPixmap;
+    return ret;
+}
+
+static int SpitfireExaMarkSync(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    return (int)pdrv->SubmitSeq;
+}
+
+/* EXA calls this before any CPU access to video memory, without saying which
+   pixmap is about to be touched. The actual wait is deferred to
+   SpitfireExaPrepareAccess, which knows the pixmap and can skip it entirely
+   if the engine never touched it. Here, just take the chance to notice that
+   the engine went idle. */
+static void SpitfireExaWaitMarker(ScreenPtr pScreen, int marker)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    if (!SpitfireSeqRetired(pdrv, (CARD32)marker))
+        SpitfireEngineIdle(pdrv);
+}
+
+static Bool SpitfireExaPrepareAccess(PixmapPtr pPixmap, int index)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pPixmap->drawable.pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    /* Reading only has to wait for pending writes to the pixmap. Writing
+       must also wait for pending commands that read from it. */
+    switch (index) {
+    case EXA_PREPARE_SRC:
+    case EXA_PREPARE_MASK:
+#ifdef EXA_PREPARE_AUX_SRC
+    case EXA_PREPARE_AUX_SRC:
+    case EXA_PREPARE_AUX_MASK:
+#endif
+        SpitfireWaitSeq(pdrv, SpitfirePixmapSeq(pdrv, pPixmap, FALSE));
+        break;
+    default:
+        SpitfireWaitSeq(pdrv, SpitfirePixmapSeq(pdrv, pPixmap, TRUE));
+        break;
+    }
+    return TRUE;
+}
+
+/* Copy data from system memory into an offscreen pixmap with the CPU, using
+   the fastest copy that the CPU supports for the write-combined aperture. */
+static Bool
+SpitfireUploadToScreen(PixmapPtr pDst, int x, int y, int w, int h,
+                       char *src, int src_pitch)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDst->drawable.pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    int Bpp = pDst->drawable.bitsPerPixel >> 3;
+    int dst_pitch = exaGetPixmapPitch(pDst);
+    unsigned char *dst;
+
+    if (pDst->drawable.bitsPerPixel < 8)
+        return FALSE;
+
+    /* Only wait if the engine may still be reading or writing the pixmap */
+    SpitfireWaitSeq(pdrv, SpitfirePixmapSeq(pdrv, pDst, TRUE));
+
+    dst = pdrv->EXADriverPtr->memoryBase + exaGetPixmapOffset(pDst)
+        + y * dst_pitch + x * Bpp;
+    pdrv->UploadCopy(dst, dst_pitch, (unsigned char *)src, src_pitch, w * Bpp, h);
+    return TRUE;
+}
+
+Bool SpitfireEXAInit(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    const char *copyName;
+
+    if (!(pdrv->EXADriverPtr = exaDriverAlloc())) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+        	"Failed to allocate EXADriverRec.\n");
+        return FALSE;
+    }
+    
+    if (!dixRegisterPrivateKey(&SpitfirePixmapPrivateKeyRec, PRIVATE_PIXMAP,
+                               sizeof(SpitfirePixmapPrivRec))) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+        	"Failed to register pixmap private.\n");
+        return FALSE;
+    }
+    if (!dixRegisterPrivateKey(&SpitfireGCPrivateKeyRec, PRIVATE_GC,
+                               sizeof(SpitfireGCPrivRec))) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+        	"Failed to register GC private.\n");
+        return FALSE;
+    }
+
+    pdrv->EXADriverPtr->exa_major = 2;
+    pdrv->EXADriverPtr->exa_minor = 0;
+    
+    /* use the linear aperture */
+    pdrv->EXADriverPtr->memoryBase = pdrv->FBBase + pScrn->fbOffset;
+    pdrv->EXADriverPtr->memorySize = pdrv->videoRambytes;
+    pdrv->EXADriverPtr->offScreenBase = pScrn->virtualY * pdrv->lDelta;
+
+    if (pdrv->EXADriverPtr->memorySize > pdrv->EXADriverPtr->offScreenBase) {
+        pdrv->EXADriverPtr->flags = EXA_OFFSCREEN_PIXMAPS;
+    } else {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+            "Not enough video RAM for EXA offscreen memory manager.\n");
+    }
+    pdrv->EXADriverPtr->pixmapPitchAlign = 32;
+    pdrv->EXADriverPtr->pixmapOffsetAlign = 8;
+
+    /* engine has 12 bit coordinates. Solid and Copy reach further down by 
+       rebasing the pixmaps, everything else takes pixmaps up to 4096 lines
+       only. */
+    pdrv->EXADriverPtr->maxX = 4096;
+    pdrv->EXADriverPtr->maxY = 8192;
+
+    /* Sync */
+    pdrv->EXADriverPtr->MarkSync = SpitfireExaMarkSync;
+    pdrv->EXADriverPtr->WaitMarker = SpitfireExaWaitMarker;
+    pdrv->EXADriverPtr->PrepareAccess = SpitfireExaPrepareAccess;
+
+    /* Transfers between system memory and the framebuffer */
+    pdrv->UploadCopy = SpitfireSelectUploadCopy(&copyName);
+    pdrv->EXADriverPtr->UploadToScreen = SpitfireUploadToScreen;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "Using %s copies for uploads to video memory.\n", copyName);
+    pdrv->DownloadCopy = SpitfireSelectDownloadCopy(&copyName);
+    pdrv->StagingArea = NULL;
+    pdrv->EXADriverPtr->DownloadFromScreen = SpitfireDownloadFromScreen;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "Using %s copies for downloads from video memory.\n", copyName);
+
+    /* Solid fill */
+    pdrv->EXADriverPtr->PrepareSolid = SpitfirePrepareSolid;
+    pdrv->EXADriverPtr->DoneSolid = SpitfireDoneSolid;
+
+    /* Copy */
+    pdrv->EXADriverPtr->PrepareCopy = SpitfirePrepareCopy;
+    pdrv->EXADriverPtr->DoneCopy = SpitfireDoneCopy;
+
+    /* Per-rectangle Solid and Copy for the depth of the screen */
+    SpitfireEXAInstallBppFuncs(pdrv->EXADriverPtr, pScrn->bitsPerPixel);
+
+#ifdef RENDER
+    /* Composite, only what comes down to a Solid or a Copy */
+    pdrv->EXADriverPtr->CheckComposite = SpitfireCheckComposite;
+    pdrv->EXADriverPtr->PrepareComposite = SpitfirePrepareComposite;
+    pdrv->EXADriverPtr->Composite = SpitfireCompositeRect;
+    pdrv->EXADriverPtr->DoneComposite = SpitfireDoneComposite;
+#endif
+
+    if(!exaDriverInit(pScreen, pdrv->EXADriverPtr)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                   "exaDriverinit failed.\n");
+        return FALSE;
+    } else {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "Spitfire EXA Acceleration enabled.\n");
+
+        /* EXA has no hooks for lines, text or patterns, those are taken
+           over at the GC. Glyphs are cached until their font is unrealized. */
+        pdrv->CreateGC = pScreen->CreateGC;
+        pScreen->CreateGC = SpitfireCreateGC;
+        pdrv->GlyphCache = calloc(1, sizeof(SpitfireGlyphCacheRec));
+        pdrv->GlyphArea = NULL;
+        memset(pdrv->StippleCache, 0, sizeof(pdrv->StippleCache));
+        pdrv->PatternArea = NULL;
+        pdrv->SeedArea = NULL;
+        pdrv->SeedValid = FALSE;
+        pdrv->UnrealizeFont = pScreen->UnrealizeFont;
+        pScreen->UnrealizeFont = SpitfireUnrealizeFont;
+        pdrv->FreedSeq = pdrv->SubmitSeq;
+        pdrv->DestroyPixmap = pScreen->DestroyPixmap;
+        pScreen->DestroyPixmap = SpitfireDestroyPixmap;
+#ifdef SPITFIRE_MASKED_COPY
+        /* Masked copies, which EXA would not pass on */
+        pdrv->MaskArea = NULL;
+        pdrv->MaskSeq[0] = pdrv->MaskSeq[1] = pdrv->SubmitSeq;
+        pdrv->MaskHalf = 0;
+        if (GetPictureScreenIfSet(pScreen)) {
+            pdrv->Composite = GetPictureScreen(pScreen)->Composite;
+            GetPictureScreen(pScreen)->Composite = SpitfireComposite;
+        }
+#endif
+        return TRUE;
+    }
+}
+
+static int SpitfireGetSolidROP(int rop) {
+
+    int ALUSolidROP[16] =
+    {
+    /* GXclear      */      0x00,         /* 0 */
+    /* GXand        */      0xA0,         /* src AND dst */
+    /* GXandReverse */      0x50,         /* src AND NOT dst */
+    /* GXcopy       */      0xF0,         /* src */
+    /* GXandInverted*/      0x0A,         /* NOT src AND dst */
+    /* GXnoop       */      0xAA,         /* dst */
+    /* GXxor        */      0x5A,         /* src XOR dst */
+    /* GXor         */      0xFA,         /* src OR dst */
+    /* GXnor        */      0x05,         /* NOT src AND NOT dst */
+    /* GXequiv      */      0xA5,         /* NOT src XOR dst */
+    /* GXinvert     */      0x55,         /* NOT dst */
+    /* GXorReverse  */      0xF5,         /* src OR NOT dst */
+    /* GXcopyInverted*/     0x0F,         /* NOT src */
+    /* GXorInverted */      0xAF,         /* NOT src OR dst */
+    /* GXnand       */      0x5F,         /* NOT src OR NOT dst */
+    /* GXset        */      0xFF,         /* 1 */
+
+    };
+    return (ALUSolidROP[rop]);
+}
+
+int SpitfireGetCopyROP(int rop) {
+
+    int ALUCopyROP[16] =
+    {
+       0x00, /*ROP_0 GXclear */
+       0x88, /*ROP_DSa GXand */
+       0x44, /*ROP_SDna GXandReverse */
+       0xCC, /*ROP_S GXcopy */
+       0x22, /*ROP_DSna GXandInverted */
+       0xAA, /*ROP_D GXnoop */
+       0x66, /*ROP_DSx GXxor */
+       0xEE, /*ROP_DSo GXor */
+       0x11, /*ROP_DSon GXnor */
+       0x99, /*ROP_DSxn GXequiv */
+       0x55, /*ROP_Dn GXinvert*/
+       0xDD, /*ROP_SDno GXorReverse */
+       0x33, /*ROP_Sn GXcopyInverted */
+       0xBB, /*ROP_DSno GXorInverted */
+       0x77, /*ROP_DSan GXnand */
+       0xFF, /*ROP_1 GXset */
+    };
+
+    return (ALUCopyROP[rop]);
+}
+
+/* Program pPixmap from line band onwards, as far down as the engine reaches.
+   With wide, a 24bpp pixmap is programmed at 16bpp for SpitfireWideBlit. */
+static void
+SpitfireEXASetupBand(SpitfirePtr pdrv, PixmapPtr pPixmap, unsigned int index,
+                     int band, Bool wide)
+{
+    int bpp = pPixmap->drawable.bitsPerPixel;
+    int pitch = exaGetPixmapPitch(pPixmap);
+
+    SpitfireSetupPixMap(pdrv, index, 
+        exaGetPixmapOffset(pPixmap) + band * pitch,
+        (wide ? pitch >> 1 : pitch >> SpitfireBppShift[bpp >> 3]) - 1,
+        min(pPixmap->drawable.height - band, 0x1000) - 1, 
+        wide ? SPITFIRE_FORMAT_16BPP : SpitfireBppFormat[bpp >> 3]);
+}
+
+static void SpitfireEXASetupPixmap(SpitfirePtr pdrv, PixmapPtr pPixmap, unsigned int index)
+{
+    SpitfireEXASetupBand(pdrv, pPixmap, index, 0, FALSE);
+}
+
+/* Submit every queued rectangle with the command saved by Prepare*. Only the
+   dimensions and offsets change between rectangles, everything else was 
+   programmed once by Prepare*. */
+static void
+SpitfireFlushRects(SpitfirePtr pdrv)
+{
+    SpitfireRectPtr rect = pdrv->RectQueue;
+    CARD32 cmd = pdrv->SavedAccelCmd;
+    int n;
+
+    for (n = pdrv->RectCount; n > 0; n--, rect++) {
+        /* Wait for room in the coprocessor command buffer */
+        SpitfireWaitCmdSlot(pdrv);
+
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, rect->w - 1, rect->h - 1);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, rect->srcX, rect->srcY);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, rect->dstX, rect->dstY);
+
+        SpitfireKickCmd(pdrv, cmd);
+    }
+    pdrv->RectCount = 0;
+}
+
+/* Get the next free slot in the rectangle queue, flushing it if full */
+static SpitfireRectPtr
+SpitfireQueueRect(SpitfirePtr pdrv)
+{
+    if (pdrv->RectCount == SPITFIRE_RECT_QUEUE_SIZE)
+        SpitfireFlushRects(pdrv);
+    return &pdrv->RectQueue[pdrv->RectCount++];
+}
+
+/* Rebase the pixmaps of a tall Solid or Copy onto the bands that hold a strip
+   of h rows, and make its y coordinates relative to them. srcY is NULL for a
+   Solid. Rectangles queued so far were made against the old bands, so they
+   are sent first. */
+static void
+SpitfireEXABands(SpitfirePtr pdrv, PixmapPtr pDst, int *srcY, int *dstY, int h)
+{
+    int src = srcY ? SpitfireBandOf(*srcY, h) : 0;
+    int dst = SpitfireBandOf(*dstY, h);
+
+    if (src != pdrv->Accel.SrcBand || dst != pdrv->Accel.DstBand) {
+        SpitfireFlushRects(pdrv);
+        if (srcY)
+            SpitfireEXASetupBand(pdrv, pdrv->CopySrcPixmap,
+                SPITFIRE_INDEX_PIXMAP_A, src, pdrv->Accel.Wide);
+        SpitfireEXASetupBand(pdrv, pDst, SPITFIRE_INDEX_PIXMAP_C, dst,
+                             pdrv->Accel.Wide);
+        pdrv->Accel.SrcBand = src;
+        pdrv->Accel.DstBand = dst;
+    }
+    if (srcY)
+        *srcY -= src;
+    *dstY -= dst;
+}
+
+/* Screen of the Solid, Copy or Composite in progress, set by Prepare*. EXA
+   runs one at a time, from Prepare to Done, so the per-rectangle hooks take
+   it from here instead of looking it up through the pixmap's screen. */
+static SpitfirePtr SpitfireEXAActive;
+
+/* EXA is taking the seed row away to make room for something else */
+static void
+SpitfireSeedSave(ScreenPtr pScreen, ExaOffscreenArea *area)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    if (pdrv->SeedArea == area) {
+        pdrv->SeedArea = NULL;
+        pdrv->SeedValid = FALSE;
+        SpitfireFreeSeq(pdrv, pdrv->SeedSeq);
+    }
+}
+
+/* Full color solid fill of a 24bpp pixmap, from a seed row in an offscreen
+   area of its own */
+static Bool
+SpitfirePrepareSeedFill(PixmapPtr pPixmap, int alu, Pixel planemask, Pixel fg)
+{
+    ScreenPtr pScreen = pPixmap->drawable.pScreen;
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    if (!pdrv->SeedArea) {
+        pdrv->SeedArea = exaOffscreenAlloc(pScreen, SPITFIRE_SEED_BYTES + 1, 64,
+                                           FALSE, SpitfireSeedSave, NULL);
+        pdrv->SeedBytes = SPITFIRE_SEED_BYTES;
+        pdrv->SeedValid = FALSE;
+        pdrv->SeedSeq = pdrv->FreedSeq;
+
+        /* Making room may have pushed out the destination */
+        if (!pdrv->SeedArea || !exaDrawableIsOffscreen(&pPixmap->drawable))
+            return FALSE;
+    }
+
+    SpitfireSetPixelBitmask(pdrv, ~0);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, 0xCC); /* GXcopy */
+    if (pdrv->Accel.Wide)
+        SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_A, pdrv->SeedArea->offset,
+            (SPITFIRE_SEED_BYTES + 1) / 2 - 1, 0, SPITFIRE_FORMAT_16BPP);
+    else
+        SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_A, pdrv->SeedArea->offset,
+            SPITFIRE_SEED_BYTES, 0, SPITFIRE_FORMAT_8BPP);
+    SpitfireSeedRow(pdrv, pdrv->EXADriverPtr->memoryBase + pdrv->SeedArea->offset,
+        SPITFIRE_SRC_PIXMAP_A | SPITFIRE_DST_PIXMAP_A, 0, 0, fg);
+
+    SpitfireSetPixelBitmask(pdrv, planemask);
+    SpitfireSetRopMix(pdrv, SpitfireGetCopyROP(alu));
+    SpitfireEXASetupBand(pdrv, pPixmap, SPITFIRE_INDEX_PIXMAP_C, 0, pdrv->Accel.Wide);
+
+    pdrv->Accel.SeedFill = TRUE;
+    pdrv->Accel.FillColor = fg;
+    pdrv->Accel.FillCopy = (alu == GXcopy);
+    pdrv->Accel.FillCpu = (alu == GXcopy) && (planemask & 0xFFFFFF) == 0xFFFFFF;
+    pdrv->Accel.XScale = 3;
+    return TRUE;
+}
+
+static Bool
+SpitfirePrepareSolid(PixmapPtr pPixmap, int alu, Pixel planemask, Pixel fg)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pPixmap->drawable.pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    unsigned int cmd;
+
+    cmd = SPITFIRE_CMD_FILL
+        | SPITFIRE_PAT_FOREGROUND
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_FGCOLOR /* <-- Use foreground color, not pixmap, as source */
+        | SPITFIRE_BACK_SRC_BGCOLOR;/* <-- Use background color, not pixmap, as source */
+
+    if (pdrv->EngineFailed)
+        return FALSE;
+
+    /* Depths below 8 stay in system memory, out of reach of the engine */
+    if (pPixmap->drawable.bitsPerPixel < 8)
+        return FALSE;
+    SpitfireEXAActive = pdrv;
+
+    pdrv->Accel.SeedFill = FALSE;
+    pdrv->Accel.Wide = FALSE;
+    pdrv->Accel.Tall = pPixmap->drawable.height > 0x1000;
+    pdrv->Accel.SrcBand = pdrv->Accel.DstBand = 0;
+    if (pPixmap->drawable.bitsPerPixel == 24) {
+        /* Pitches greater than 0xFFF on 24bpp are programmed at 16bpp, up to
+           the widest 16bpp pixmap, and with every plane enabled */
+        if (exaGetPixmapPitch(pPixmap) > 0xFFF) {
+            if (exaGetPixmapPitch(pPixmap) > 0x2000
+                || (planemask & 0xFFFFFF) != 0xFFFFFF)
+                return FALSE;
+            pdrv->Accel.Wide = TRUE;
+        }
+
+        /* Solid fill for 24-bit only works in grayscale, other colors go
+           through the seed row */
+        if ((((fg & 0x0000FF) != ((fg >> 8) & 0x0000FF)) || ((fg & 0x0000FF) != ((fg >> 16) & 0x0000FF))))
+            return SpitfirePrepareSeedFill(pPixmap, alu, planemask, fg);
+    }
+
+    SpitfireSetColors(pdrv, fg, fg);
+    SpitfireSetPixelBitmask(pdrv, planemask);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, SpitfireGetCopyROP(alu));
+
+    /* Set up destination pixmap */
+    SpitfireEXASetupBand(pdrv, pPixmap, SPITFIRE_INDEX_PIXMAP_C, 0, pdrv->Accel.Wide);
+    
+    pdrv->Accel.XScale = (pPixmap->drawable.bitsPerPixel == 24) ? 3 : 1;
+    pdrv->SavedAccelCmd = cmd;
+    return TRUE;
+}
+
+/* As with XAA, Solid and Copy are templates instantiated for each screen 
+   depth by SPITFIRE_EXA_BPP_FUNCS. Only 24bpp screens may see 24bpp pixmaps,
+   alongside pixmaps of other depths, so their instances take the horizontal
+   scale set by Prepare*. */
+static inline void
+SpitfireSolidRect(SpitfirePtr pdrv, PixmapPtr pPixmap, int x1, int y1,
+                  int w, int h, const int bpp)
+{
+    SpitfireRectPtr rect;
+    int band = 0;
+
+    if (pdrv->Accel.Tall) {
+        SpitfireEXABands(pdrv, pPixmap, NULL, &y1, h);
+        band = pdrv->Accel.DstBand;
+    }
+
+    /* On 24bpp, we are pretending to work at 8bpp, so triple all dimensions */
+    if (bpp == 24) {
+        if (pdrv->Accel.SeedFill) {
+            int pitch = exaGetPixmapPitch(pPixmap);
+
+            SpitfireSeedFill(pdrv, pdrv->EXADriverPtr->memoryBase
+                + exaGetPixmapOffset(pPixmap) + band * pitch,
+                pitch, x1, y1, w, h, 0, 0);
+            return;
+        }
+        x1 *= pdrv->Accel.XScale; w *= pdrv->Accel.XScale;
+        if (pdrv->Accel.Wide) {
+            SpitfireWideBlit(pdrv, pdrv->SavedAccelCmd, x1, y1, x1, y1, w, h);
+            return;
+        }
+    }
+
+    /* Queued until DoneSolid, or until the queue fills up */
+    rect = SpitfireQueueRect(pdrv);
+    rect->srcX = rect->dstX = x1;
+    rect->srcY = rect->dstY = y1;
+    rect->w = w;
+    rect->h = h;
+}
+
+static inline void
+SpitfireSolidTmpl(PixmapPtr pPixmap, int x1, int y1, int x2, int y2, const int bpp)
+{
+    SpitfirePtr pdrv = SpitfireEXAActive;
+    int h = y2 - y1;
+    int n;
+
+    if (!pdrv->Accel.Tall) {
+        SpitfireSolidRect(pdrv, pPixmap, x1, y1, x2 - x1, h, bpp);
+        return;
+    }
+
+    /* Tall pixmaps are filled in strips that each fit a band */
+    for (; h > 0; h -= n, y1 += n) {
+        n = min(h, SPITFIRE_BAND_LINES);
+        SpitfireSolidRect(pdrv, pPixmap, x1, y1, x2 - x1, n, bpp);
+    }
+}
+
+static void
+SpitfireDoneSolid(PixmapPtr pPixmap)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pPixmap->drawable.pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    SpitfireFlushRects(pdrv);
+    SpitfireMarkPixmap(pdrv, pPixmap, TRUE);
+}
+
+static Bool
+SpitfirePrepareCopy(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap, int xdir, int ydir,
+					int alu, Pixel planemask)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pSrcPixmap->drawable.pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    unsigned int cmd;
+
+    cmd = SPITFIRE_CMD_BITBLT
+        | SPITFIRE_SRC_PIXMAP_A
+        | SPITFIRE_PAT_FOREGROUND
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_PIXMAP
+        | SPITFIRE_BACK_SRC_PIXMAP;
+    if (xdir < 0) cmd |= SPITFIRE_DEC_X;
+    if (ydir < 0) cmd |= SPITFIRE_DEC_Y;
+
+    if (pdrv->EngineFailed)
+        return FALSE;
+    SpitfireEXAActive = pdrv;
+
+    /* Depths below 8 stay in system memory, out of reach of the engine */
+    if (pSrcPixmap->drawable.bitsPerPixel < 8 || pDstPixmap->drawable.bitsPerPixel < 8)
+        return FALSE;
+
+    /* Cannot accelerate copy when just one of the pixmaps is 24bpp */
+    if ((pSrcPixmap->drawable.bitsPerPixel == 24 || pDstPixmap->drawable.bitsPerPixel == 24)
+        && pSrcPixmap->drawable.bitsPerPixel != pDstPixmap->drawable.bitsPerPixel)
+        return FALSE;
+
+    pdrv->Accel.Wide = FALSE;
+    pdrv->Accel.Tall = pSrcPixmap->drawable.height > 0x1000
+        || pDstPixmap->drawable.height > 0x1000;
+    pdrv->Accel.SrcBand = pdrv->Accel.DstBand = 0;
+    if (pDstPixmap->drawable.bitsPerPixel == 24) {
+        /* Pitches greater than 0xFFF on 24bpp are programmed at 16bpp, for
+           both pixmaps, up to the widest 16bpp pixmap and with every plane
+           enabled */
+        if (exaGetPixmapPitch(pSrcPixmap) > 0xFFF 
+            || exaGetPixmapPitch(pDstPixmap) > 0xFFF) {
+            if (exaGetPixmapPitch(pSrcPixmap) > 0x2000
+                || exaGetPixmapPitch(pDstPixmap) > 0x2000
+                || (planemask & 0xFFFFFF) != 0xFFFFFF)
+                return FALSE;
+            pdrv->Accel.Wide = TRUE;
+        }
+    }
+
+    SpitfireSetPixelBitmask(pdrv, planemask);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, SpitfireGetCopyROP(alu));
+    
+    /* Set up source and destination pixmaps */
+    SpitfireEXASetupBand(pdrv, pSrcPixmap, SPITFIRE_INDEX_PIXMAP_A, 0, pdrv->Accel.Wide);
+    SpitfireEXASetupBand(pdrv, pDstPixmap, SPITFIRE_INDEX_PIXMAP_C, 0, pdrv->Accel.Wide);
+
+    pdrv->Accel.XScale = (pDstPixmap->drawable.bitsPerPixel == 24) ? 3 : 1;
+    pdrv->CopySrcPixmap = pSrcPixmap;
+    pdrv->SavedAccelCmd = cmd;
+    return TRUE;
+}
+
+static inline void
+SpitfireCopyRect(SpitfirePtr pdrv, PixmapPtr pDstPixmap, int srcX, int srcY,
+                 int dstX, int dstY, int width, int height, const int bpp)
+{
+    SpitfireRectPtr rect;
+
+    if (pdrv->Accel.Tall)
+        SpitfireEXABands(pdrv, pDstPixmap, &srcY, &dstY, height);
+
+    /* On 24bpp, we are pretending to work at 8bpp, so triple all dimensions */
+    if (bpp == 24) {
+        srcX *= pdrv->Accel.XScale;
+        dstX *= pdrv->Accel.XScale;
+        width *= pdrv->Accel.XScale;
+        if (pdrv->Accel.Wide) {
+            SpitfireWideBlit(pdrv, pdrv->SavedAccelCmd, srcX, srcY, dstX, dstY,
+                             width, height);
+            return;
+        }
+    }
+
+    /* When specifying SPITFIRE_DEC_[XY], we need to specify the rightmost or
+     * bottommost pixel coordinate, as required. */
+    if (pdrv->SavedAccelCmd & SPITFIRE_DEC_X) {
+        srcX += width - 1;
+        dstX += width - 1;
+    }
+    if (pdrv->SavedAccelCmd & SPITFIRE_DEC_Y) {
+        srcY += height - 1;
+        dstY += height - 1;
+    }
+
+    /* Queued until DoneCopy, or until the queue fills up */
+    rect = SpitfireQueueRect(pdrv);
+    rect->srcX = srcX;
+    rect->srcY = srcY;
+    rect->dstX = dstX;
+    rect->dstY = dstY;
+    rect->w = width;
+    rect->h = height;
+}
+
+static inline void
+SpitfireCopyTmpl(PixmapPtr pDstPixmap, int srcX, int srcY, int dstX, int dstY, 
+                 int width, int height, const int bpp)
+{
+    SpitfirePtr pdrv = SpitfireEXAActive;
+    int n;
+
+    if (!pdrv->Accel.Tall) {
+        SpitfireCopyRect(pdrv, pDstPixmap, srcX, srcY, dstX, dstY,
+                         width, height, bpp);
+        return;
+    }
+
+    /* Tall pixmaps are copied in strips that each fit a band, bottom up if
+       the engine was asked to */
+    for (; height > 0; height -= n) {
+        n = min(height, SPITFIRE_BAND_LINES);
+        if (pdrv->SavedAccelCmd & SPITFIRE_DEC_Y) {
+            SpitfireCopyRect(pdrv, pDstPixmap, srcX, srcY + height - n,
+                             dstX, dstY + height - n, width, n, bpp);
+        } else {
+            SpitfireCopyRect(pdrv, pDstPixmap, srcX, srcY, dstX, dstY,
+                             width, n, bpp);
+            srcY += n;
+            dstY += n;
+        }
+    }
+}
+
+static void
+SpitfireDoneCopy(PixmapPtr pDstPixmap)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDstPixmap->drawable.pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    SpitfireFlushRects(pdrv);
+    SpitfireMarkPixmap(pdrv, pdrv->CopySrcPixmap, FALSE);
+    SpitfireMarkPixmap(pdrv, pDstPixmap, TRUE);
+}
+
+#define SPITFIRE_EXA_BPP_FUNCS(bpp)                                         \
+static void SpitfireSolid##bpp(PixmapPtr pPixmap,                           \
+    int x1, int y1, int x2, int y2)                                         \
+{                                                                           \
+    SpitfireSolidTmpl(pPixmap, x1, y1, x2, y2, bpp);                        \
+}                                                                           \
+static void SpitfireCopy##bpp(PixmapPtr pDstPixmap,                         \
+    int srcX, int srcY, int dstX, int dstY, int width, int height)          \
+{                                                                           \
+    SpitfireCopyTmpl(pDstPixmap, srcX, srcY, dstX, dstY, width, height, bpp); \
+}
+
+SPITFIRE_EXA_BPP_FUNCS(8)
+SPITFIRE_EXA_BPP_FUNCS(16)
+SPITFIRE_EXA_BPP_FUNCS(24)
+SPITFIRE_EXA_BPP_FUNCS(32)
+
+/* Install the per-rectangle functions that match the depth of the screen */
+static void
+SpitfireEXAInstallBppFuncs(ExaDriverPtr exaptr, int bpp)
+{
+    switch (bpp) {
+    case 8:
+        exaptr->Solid = SpitfireSolid8;
+        exaptr->Copy = SpitfireCopy8;
+        break;
+    case 16:
+        exaptr->Solid = SpitfireSolid16;
+        exaptr->Copy = SpitfireCopy16;
+        break;
+    case 24:
+        exaptr->Solid = SpitfireSolid24;
+        exaptr->Copy = SpitfireCopy24;
+        break;
+    case 32:
+        exaptr->Solid = SpitfireSolid32;
+        exaptr->Copy = SpitfireCopy32;
+        break;
+    }
+}
+
+#ifdef RENDER
+/* Convert an a8r8g8b8 color to a pixel of an A, ARGB or ABGR format of at 
+   most 8 bits per channel. Returns FALSE for any other format. */
+static Bool
+SpitfireColorToPixel(CARD32 color, CARD32 format, Pixel *pixel)
+{
+    int a = PICT_FORMAT_A(format), r = PICT_FORMAT_R(format);
+    int g = PICT_FORMAT_G(format), b = PICT_FORMAT_B(format);
+    CARD32 alpha = color >> 24, red = (color >> 16) & 0xFF;
+    CARD32 green = (color >> 8) & 0xFF, blue = color & 0xFF;
+
+    if (a > 8 || r > 8 || g > 8 || b > 8)
+        return FALSE;
+
+    switch (PICT_FORMAT_TYPE(format)) {
+    case PICT_TYPE_A:
+        *pixel = alpha >> (8 - a);
+        return TRUE;
+    case PICT_TYPE_ABGR:
+        red = color & 0xFF;
+        blue = (color >> 16) & 0xFF;
+        /* Fall through */
+    case PICT_TYPE_ARGB:
+        *pixel = ((alpha >> (8 - a)) << (r + g + b))
+            | ((red >> (8 - r)) << (g + b))
+            | ((green >> (8 - g)) << b)
+            | (blue >> (8 - b));
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* The RENDER operations that are plain fills or copies: Clear, and Src or
+   Over of a solid color or of a picture in the format of the destination,
+   where Over needs the source to be opaque. Anything else, and anything with
+   a mask, is turned down before EXA migrates any pixmap for it. */
+static Bool
+SpitfireCheckComposite(int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
+                       PicturePtr pDstPicture)
+{
+    Pixel pixel;
+
+    if (pMaskPicture || pDstPicture->alphaMap
+        || PICT_FORMAT_BPP(pDstPicture->format) < 8)
+        return FALSE;
+    if (op == PictOpClear)
+        return TRUE;
+    if (op != PictOpSrc && op != PictOpOver)
+        return FALSE;
+
+    if (!pSrcPicture->pDrawable) {
+        CARD32 color;
+
+        if (pSrcPicture->pSourcePict->type != SourcePictTypeSolidFill)
+            return FALSE;
+        color = pSrcPicture->pSourcePict->solidFill.color;
+        return (op == PictOpSrc || (color >> 24) == 0xFF)
+            && SpitfireColorToPixel(color, pDstPicture->format, &pixel);
+    }
+
+    return !pSrcPicture->repeat && !pSrcPicture->transform
+        && !pSrcPicture->alphaMap
+        && pSrcPicture->format == pDstPicture->format
+        && (op == PictOpSrc || !PICT_FORMAT_A(pSrcPicture->format));
+}
+
+static Bool
+SpitfirePrepareComposite(int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
+                         PicturePtr pDstPicture, PixmapPtr pSrc, PixmapPtr pMask,
+                         PixmapPtr pDst)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDst->drawable.pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    Pixel pixel = 0;
+
+    pdrv->Accel.CompositeCopy = op != PictOpClear && pSrcPicture->pDrawable;
+    if (pdrv->Accel.CompositeCopy) {
+        /* EXA gives no direction to copy in */
+        if (pSrc == pDst)
+            return FALSE;
+        return SpitfirePrepareCopy(pSrc, pDst, 1, 1, GXcopy, ~0);
+    }
+
+    if (op != PictOpClear)
+        SpitfireColorToPixel(pSrcPicture->pSourcePict->solidFill.color,
+                             pDstPicture->format, &pixel);
+    return SpitfirePrepareSolid(pDst, GXcopy, ~0, pixel);
+}
+
+static void
+SpitfireCompositeRect(PixmapPtr pDst, int srcX, int srcY, int maskX, int maskY,
+                      int dstX, int dstY, int w, int h)
+{
+    SpitfirePtr pdrv = SpitfireEXAActive;
+
+    if (pdrv->Accel.CompositeCopy)
+        (*pdrv->EXADriverPtr->Copy)(pDst, srcX, srcY, dstX, dstY, w, h);
+    else
+        (*pdrv->EXADriverPtr->Solid)(pDst, dstX, dstY, dstX + w, dstY + h);
+}
+
+static void
+SpitfireDoneComposite(PixmapPtr pDst)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDst->drawable.pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    if (pdrv->Accel.CompositeCopy)
+        SpitfireDoneCopy(pDst);
+    else
+        SpitfireDoneSolid(pDst);
+}
+#endif
+
+/* Get the pixmap behind pDrawable, with the offset from screen to pixmap
+   coordinates, or NULL if the pixmap cannot be brought into video memory. */
+static PixmapPtr
+SpitfireGetDrawingPixmap(DrawablePtr pDrawable, int *dx, int *dy)
+{
+    PixmapPtr pPixmap = exaGetDrawablePixmap(pDrawable);
+
+    if (DEVPTR(xf86ScreenToScrn(pDrawable->pScreen))->EngineFailed)
+        return NULL;
+
+    /* Only Solid and Copy reach past the first 4096 lines */
+    if (!exaDrawableIsOffscreen(pDrawable) || pPixmap->drawable.height > 0x1000)
+        return NULL;
+
+    /* Let EXA bring in any changes made to the copy in system memory */
+    exaMoveInPixmap(pPixmap);
+
+    *dx = *dy = 0;
+#ifdef COMPOSITE
+    if (pDrawable->type == DRAWABLE_WINDOW) {
+        *dx = -pPixmap->screen_x;
+        *dy = -pPixmap->screen_y;
+    }
+#endif
+    return pPixmap;
+}
+
+/* Get the engine ready to draw the lines of pGC into pDrawable. Returns the
+   pixmap to draw into as SpitfireGetDrawingPixmap does. */
+static PixmapPtr
+SpitfirePrepareLines(DrawablePtr pDrawable, GCPtr pGC, int *dx, int *dy)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDrawable->pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    PixmapPtr pPixmap;
+    unsigned int cmd;
+
+    if (!(pPixmap = SpitfireGetDrawingPixmap(pDrawable, dx, dy)))
+        return NULL;
+
+    cmd = SPITFIRE_CMD_LINE_DRAW_WRITE
+        | SPITFIRE_PAT_FOREGROUND
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_FGCOLOR
+        | SPITFIRE_BACK_SRC_BGCOLOR;
+
+    SpitfireSetColors(pdrv, pGC->fgPixel, pGC->fgPixel);
+    SpitfireSetPixelBitmask(pdrv, pGC->planemask);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, SpitfireGetCopyROP(pGC->alu));
+
+    /* Set up destination pixmap */
+    SpitfireEXASetupPixmap(pdrv, pPixmap, SPITFIRE_INDEX_PIXMAP_C);
+
+    pdrv->SavedAccelCmd = cmd;
+    return pPixmap;
+}
+
+/* Finish drawing lines or text into pDrawable, within the given inclusive
+   bounds in screen coordinates. The drawing never went through EXA or fb, so
+   both the sync tracking and the damage layer have to be told about it here. */
+static void
+SpitfireDoneGCDraw(DrawablePtr pDrawable, GCPtr pGC, PixmapPtr pPixmap,
+                   int x1, int y1, int x2, int y2)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDrawable->pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    BoxPtr pExtents = RegionExtents(pGC->pCompositeClip);
+    RegionRec region;
+    BoxRec box;
+
+    SpitfireMarkPixmap(pdrv, pPixmap, TRUE);
+    exaMarkSync(pDrawable->pScreen);
+
+    box.x1 = max(x1, pExtents->x1);
+    box.y1 = max(y1, pExtents->y1);
+    box.x2 = min(x2 + 1, pExtents->x2);
+    box.y2 = min(y2 + 1, pExtents->y2);
+    if (box.x1 >= box.x2 || box.y1 >= box.y2)
+        return;
+
+    RegionInit(&region, &box, 1);
+    RegionIntersect(&region, &region, pGC->pCompositeClip);
+    DamageRegionAppend(pDrawable, &region);
+    DamageRegionProcessPending(pDrawable);
+    RegionUninit(&region);
+}
+
+static void
+SpitfirePolylines(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
+                  DDXPointPtr ppt)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDrawable->pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    SpitfireGCPrivPtr priv = SpitfireGetGCPriv(pGC);
+    RegionPtr pClip = pGC->pCompositeClip;
+    unsigned int bias = miGetZeroLineBias(pDrawable->pScreen);
+    BoxPtr pBox = (RegionNumRects(pClip) == 1) ? RegionRects(pClip) : NULL;
+    PixmapPtr pPixmap = NULL;
+    SpitfireStrokeRec strokes;
+    int x1, y1, x2, y2, dx, dy;
+    int minX, minY, maxX, maxY;
+    Bool drawLast;
+
+    if (npt < 2 || !(pPixmap = SpitfirePrepareLines(pDrawable, pGC, &dx, &dy))) {
+        pGC->ops = priv->wrapOps;
+        (*pGC->ops->Polylines)(pDrawable, pGC, mode, npt, ppt);
+        pGC->ops = &priv->ops;
+        return;
+    }
+
+    /* Short runs of unclipped lines go out as short strokes, four to a
+       register write, the rest as full Bresenham lines */
+    SpitfireStrokeInit(&strokes, pdrv->SavedAccelCmd, dx, dy);
+
+    /* Points are relative to the drawable, lines are clipped in screen 
+       coordinates, just like fbZeroLine does */
+    x1 = ppt->x + pDrawable->x;
+    y1 = ppt->y + pDrawable->y;
+    minX = maxX = x1;
+    minY = maxY = y1;
+    while (--npt) {
+        ppt++;
+        if (mode == CoordModePrevious) {
+            x2 = x1 + ppt->x;
+            y2 = y1 + ppt->y;
+        } else {
+            x2 = ppt->x + pDrawable->x;
+            y2 = ppt->y + pDrawable->y;
+        }
+
+        drawLast = npt == 1 && pGC->capStyle != CapNotLast;
+        if (!pBox || !SpitfireStrokeLine(pdrv, &strokes, pBox, 
+                                         x1, y1, x2, y2, drawLast)) {
+            SpitfireStrokeBreak(pdrv, &strokes);
+            SpitfireClipLine(pdrv, pdrv->SavedAccelCmd, x1, y1, x2, y2,
+                             drawLast, bias,
+                             RegionRects(pClip), RegionNumRects(pClip), dx, dy);
+        }
+
+        minX = min(minX, x2); maxX = max(maxX, x2);
+        minY = min(minY, y2); maxY = max(maxY, y2);
+        x1 = x2;
+        y1 = y2;
+    }
+    SpitfireStrokeFlush(pdrv, &strokes);
+
+    SpitfireDoneGCDraw(pDrawable, pGC, pPixmap, minX, minY, maxX, maxY);
+}
+
+static void
+SpitfirePolySegment(DrawablePtr pDrawable, GCPtr pGC, int nseg, xSegment *pSeg)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDrawable->pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    SpitfireGCPrivPtr priv = SpitfireGetGCPriv(pGC);
+    RegionPtr pClip = pGC->pCompositeClip;
+    unsigned int bias = miGetZeroLineBias(pDrawable->pScreen);
+    Bool drawLast = pGC->capStyle != CapNotLast;
+    BoxPtr pBox = (RegionNumRects(pClip) == 1) ? RegionRects(pClip) : NULL;
+    PixmapPtr pPixmap = NULL;
+    SpitfireStrokeRec strokes;
+    int x1, y1, x2, y2, dx, dy;
+    int minX, minY, maxX, maxY;
+
+    if (nseg < 1 || !(pPixmap = SpitfirePrepareLines(pDrawable, pGC, &dx, &dy))) {
+        pGC->ops = priv->wrapOps;
+        (*pGC->ops->PolySegment)(pDrawable, pGC, nseg, pSeg);
+        pGC->ops = &priv->ops;
+        return;
+    }
+
+    /* Each short segment costs its start point and one stroke word */
+    SpitfireStrokeInit(&strokes, pdrv->SavedAccelCmd, dx, dy);
+
+    minX = minY = MAXSHORT;
+    maxX = maxY = MINSHORT;
+    for (; nseg > 0; nseg--, pSeg++) {
+        x1 = pSeg->x1 + pDrawable->x;
+        y1 = pSeg->y1 + pDrawable->y;
+        x2 = pSeg->x2 + pDrawable->x;
+        y2 = pSeg->y2 + pDrawable->y;
+
+        if (!pBox || !SpitfireStrokeLine(pdrv, &strokes, pBox,
+                                         x1, y1, x2, y2, drawLast)) {
+            SpitfireStrokeBreak(pdrv, &strokes);
+            SpitfireClipLine(pdrv, pdrv->SavedAccelCmd, x1, y1, x2, y2,
+                             drawLast, bias,
+                             RegionRects(pClip), RegionNumRects(pClip), dx, dy);
+        }
+
+        minX = min(minX, min(x1, x2)); maxX = max(maxX, max(x1, x2));
+        minY = min(minY, min(y1, y2)); maxY = max(maxY, max(y1, y2));
+    }
+    SpitfireStrokeFlush(pdrv, &strokes);
+
+    SpitfireDoneGCDraw(pDrawable, pGC, pPixmap, minX, minY, maxX, maxY);
+}
+
+static void
+SpitfireGlyphUnlink(SpitfireGlyphCachePtr cache, int i)
+{
+    SpitfireGlyphSlotPtr slot = &cache->slots[i];
+
+    cache->slots[slot->lruPrev].lruNext = slot->lruNext;
+    cache->slots[slot->lruNext].lruPrev = slot->lruPrev;
+}
+
+/* Put slot i in the use list right after slot prev */
+static void
+SpitfireGlyphLink(SpitfireGlyphCachePtr cache, int i, int prev)
+{
+    SpitfireGlyphSlotPtr slot = &cache->slots[i];
+
+    slot->lruPrev = prev;
+    slot->lruNext = cache->slots[prev].lruNext;
+    cache->slots[slot->lruNext].lruPrev = i;
+    cache->slots[prev].lruNext = i;
+}
+
+/* Take the glyph in slot i out of the cache */
+static void
+SpitfireGlyphForget(SpitfireGlyphCachePtr cache, int i)
+{
+    SpitfireGlyphSlotPtr slot = &cache->slots[i];
+    int *link = &cache->hash[SpitfireGlyphHash(slot->pci)];
+
+    while (*link != i)
+        link = &cache->slots[*link].hashNext;
+    *link = slot->hashNext;
+    slot->pFont = NULL;
+    slot->pci = NULL;
+}
+
+/* Empty the cache, the atlas is new or its contents are lost */
+static void
+SpitfireGlyphCacheReset(SpitfireGlyphCachePtr cache)
+{
+    int i;
+
+    for (i = 0; i < SPITFIRE_GLYPH_HASH_SIZE; i++)
+        cache->hash[i] = -1;
+    for (i = 0; i <= SPITFIRE_GLYPH_SLOTS; i++) {
+        cache->slots[i].pFont = NULL;
+        cache->slots[i].pci = NULL;
+        cache->slots[i].hashNext = -1;
+        cache->slots[i].lruPrev = (i + SPITFIRE_GLYPH_SLOTS) % (SPITFIRE_GLYPH_SLOTS + 1);
+        cache->slots[i].lruNext = (i + 1) % (SPITFIRE_GLYPH_SLOTS + 1);
+        cache->slots[i].seq = 0;
+    }
+}
+
+/* EXA is taking the atlas away to make room for something else */
+static void
+SpitfireGlyphAtlasSave(ScreenPtr pScreen, ExaOffscreenArea *area)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    if (pdrv->GlyphArea == area) {
+        pdrv->GlyphArea = NULL;
+        SpitfireFreeSeq(pdrv, pdrv->SubmitSeq);
+    }
+}
+
+/* Make sure the atlas is in video memory, allocating it on first use */
+static Bool
+SpitfireGlyphAtlasReady(ScreenPtr pScreen, SpitfirePtr pdrv)
+{
+    if (!pdrv->GlyphCache)
+        return FALSE;
+    if (pdrv->GlyphArea)
+        return TRUE;
+
+    pdrv->GlyphArea = exaOffscreenAlloc(pScreen, SPITFIRE_GLYPH_ATLAS_SIZE, 64,
+                                        FALSE, SpitfireGlyphAtlasSave, NULL);
+    if (!pdrv->GlyphArea)
+        return FALSE;
+
+    /* The engine may still be using whatever was here before */
+    SpitfireWaitSeq(pdrv, pdrv->FreedSeq);
+    memset(pdrv->EXADriverPtr->memoryBase + pdrv->GlyphArea->offset, 0,
+           SPITFIRE_GLYPH_SIZE * SPITFIRE_GLYPH_PITCH);
+    SpitfireGlyphCacheReset(pdrv->GlyphCache);
+    return TRUE;
+}
+
+/* Find the slot holding a glyph, uploading the glyph into the least recently
+   used slot if it is not in the atlas yet. The slot becomes the most recently
+   used one. */
+static int
+SpitfireGlyphLookup(SpitfirePtr pdrv, FontPtr pFont, CharInfoPtr pci)
+{
+    SpitfireGlyphCachePtr cache = pdrv->GlyphCache;
+    SpitfireGlyphSlotPtr slot;
+    int *bucket = &cache->hash[SpitfireGlyphHash(pci)];
+    int i, h, stride, n;
+    unsigned char *dst;
+    const unsigned char *src;
+
+    for (i = *bucket; i >= 0; i = cache->slots[i].hashNext)
+        if (cache->slots[i].pci == pci && cache->slots[i].pFont == pFont)
+            break;
+
+    if (i < 0) {
+        i = cache->slots[SPITFIRE_GLYPH_LRU_HEAD].lruPrev;
+        slot = &cache->slots[i];
+        if (slot->pci)
+            SpitfireGlyphForget(cache, i);
+
+        /* The slot may still be read by an earlier blit */
+        SpitfireWaitSeq(pdrv, slot->seq);
+
+        dst = pdrv->EXADriverPtr->memoryBase + pdrv->GlyphArea->offset
+            + (i / SPITFIRE_GLYPH_PER_ROW + 1) * SPITFIRE_GLYPH_SIZE * SPITFIRE_GLYPH_PITCH
+            + (i % SPITFIRE_GLYPH_PER_ROW) * (SPITFIRE_GLYPH_SIZE / 8);
+        src = (const unsigned char *)pci->bits;
+        stride = GLYPHWIDTHBYTESPADDED(pci);
+        n = min(stride, SPITFIRE_GLYPH_SIZE / 8);
+        for (h = GLYPHHEIGHTPIXELS(pci); h > 0; h--) {
+            memcpy(dst, src, n);
+            dst += SPITFIRE_GLYPH_PITCH;
+            src += stride;
+        }
+
+        slot->pFont = pFont;
+        slot->pci = pci;
+        slot->hashNext = *bucket;
+        *bucket = i;
+    }
+
+    SpitfireGlyphUnlink(cache, i);
+    SpitfireGlyphLink(cache, i, SPITFIRE_GLYPH_LRU_HEAD);
+    return i;
+}
+
+/* Drop every glyph of a font that is going away, its CharInfo records may be
+   reused by the next font */
+static Bool
+SpitfireUnrealizeFont(ScreenPtr pScreen, FontPtr pFont)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    SpitfireGlyphCachePtr cache = pdrv->GlyphCache;
+    Bool ret;
+    int i;
+
+    if (cache && pdrv->GlyphArea) {
+        for (i = 0; i < SPITFIRE_GLYPH_SLOTS; i++) {
+            if (cache->slots[i].pFont != pFont)
+                continue;
+            SpitfireGlyphForget(cache, i);
+            /* Free slots are the first to be reused */
+            SpitfireGlyphUnlink(cache, i);
+            SpitfireGlyphLink(cache, i, 
+                cache->slots[SPITFIRE_GLYPH_LRU_HEAD].lruPrev);
+        }
+    }
+
+    pScreen->UnrealizeFont = pdrv->UnrealizeFont;
+    ret = (*pScreen->UnrealizeFont)(pScreen, pFont);
+    pScreen->UnrealizeFont = SpitfireUnrealizeFont;
+    return ret;
+}
+
+/* Expand a rectangle of the atlas, at (patX, patY), onto (x, y) in screen
+   coordinates, clipped to the given boxes */
+static void
+SpitfireGlyphBlit(SpitfirePtr pdrv, unsigned int cmd, BoxPtr pBox, int nBox,
+                  int x, int y, int w, int h, int patX, int patY, int dx, int dy)
+{
+    int x1, y1, x2, y2;
+
+    for (; nBox > 0; nBox--, pBox++) {
+        x1 = max(x, pBox->x1);
+        y1 = max(y, pBox->y1);
+        x2 = min(x + w, pBox->x2);
+        y2 = min(y + h, pBox->y2);
+        if (x1 >= x2 || y1 >= y2)
+            continue;
+
+        SpitfireWaitCmdSlot(pdrv);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, x2 - x1 - 1, y2 - y1 - 1);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, x1 + dx, y1 + dy);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_PAT,
+                             patX + x1 - x, patY + y1 - y);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x1 + dx, y1 + dy);
+        SpitfireKickCmd(pdrv, cmd);
+    }
+}
+
+/* Get the engine and the atlas ready to draw the glyphs into pDrawable, with
+   fg and bg as colors. Returns the pixmap to draw into as
+   SpitfireGetDrawingPixmap does, or NULL if some glyph is too large for the
+   atlas. */
+static PixmapPtr
+SpitfirePrepareGlyphs(DrawablePtr pDrawable, GCPtr pGC, Pixel fg, Pixel bg,
+                      unsigned int nglyph, CharInfoPtr *ppci, int *dx, int *dy)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    SpitfirePtr pdrv = DEVPTR(xf86ScreenToScrn(pScreen));
+    PixmapPtr pPixmap;
+    unsigned int i;
+
+    for (i = 0; i < nglyph; i++)
+        if (GLYPHWIDTHPIXELS(ppci[i]) > SPITFIRE_GLYPH_SIZE
+            || GLYPHHEIGHTPIXELS(ppci[i]) > SPITFIRE_GLYPH_SIZE)
+            return NULL;
+
+    /* Bringing in the pixmap may push the atlas out again */
+    if (!SpitfireGlyphAtlasReady(pScreen, pdrv)
+        || !(pPixmap = SpitfireGetDrawingPixmap(pDrawable, dx, dy))
+        || !pdrv->GlyphArea)
+        return NULL;
+
+    SpitfireSetColors(pdrv, fg, bg);
+    SpitfireSetPixelBitmask(pdrv, pGC->planemask);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, 0xCC); /* GXcopy */
+
+    /* The destination is also the source, left untouched where the glyph
+       has no bits */
+    SpitfireEXASetupPixmap(pdrv, pPixmap, SPITFIRE_INDEX_PIXMAP_A);
+    SpitfireEXASetupPixmap(pdrv, pPixmap, SPITFIRE_INDEX_PIXMAP_C);
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_B,
+        pdrv->GlyphArea->offset, SPITFIRE_GLYPH_PITCH * 8 - 1,
+        SPITFIRE_GLYPH_ROWS * SPITFIRE_GLYPH_SIZE - 1,
+        SPITFIRE_FORMAT_1BPP | SPITFIRE_FORMAT_INTEL);
+    return pPixmap;
+}
+
+/* Draw the foreground of a run of glyphs, with its origin at (x, y) in screen
+   coordinates, and widen the bounds by what was drawn */
+static void
+SpitfireGlyphRun(SpitfirePtr pdrv, GCPtr pGC, int x, int y,
+                 unsigned int nglyph, CharInfoPtr *ppci, int dx, int dy,
+                 BoxPtr pBounds)
+{
+    RegionPtr pClip = pGC->pCompositeClip;
+    unsigned int cmd;
+    CharInfoPtr pci;
+    int i, gx, gy, w, h;
+
+    cmd = SPITFIRE_CMD_TEXT_BITBLT
+        | SPITFIRE_SRC_PIXMAP_A
+        | SPITFIRE_PAT_PIXMAP_B
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_FGCOLOR
+        | SPITFIRE_BACK_SRC_PIXMAP; /* Source is the destination, a noop */
+
+    for (; nglyph > 0; nglyph--, ppci++) {
+        pci = *ppci;
+        gx = x + pci->metrics.leftSideBearing;
+        gy = y - pci->metrics.ascent;
+        w = GLYPHWIDTHPIXELS(pci);
+        h = GLYPHHEIGHTPIXELS(pci);
+        x += pci->metrics.characterWidth;
+        if (w <= 0 || h <= 0)
+            continue;
+
+        i = SpitfireGlyphLookup(pdrv, pGC->font, pci);
+        SpitfireGlyphBlit(pdrv, cmd, RegionRects(pClip), RegionNumRects(pClip),
+            gx, gy, w, h,
+            (i % SPITFIRE_GLYPH_PER_ROW) * SPITFIRE_GLYPH_SIZE,
+            (i / SPITFIRE_GLYPH_PER_ROW + 1) * SPITFIRE_GLYPH_SIZE,
+            dx, dy);
+        pdrv->GlyphCache->slots[i].seq = pdrv->SubmitSeq;
+
+        pBounds->x1 = min(pBounds->x1, gx);
+        pBounds->y1 = min(pBounds->y1, gy);
+        pBounds->x2 = max(pBounds->x2, gx + w - 1);
+        pBounds->y2 = max(pBounds->y2, gy + h - 1);
+    }
+}
+
+static void
+SpitfirePolyGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                     unsigned int nglyph, CharInfoPtr *ppci, pointer pglyphBase)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDrawable->pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    SpitfireGCPrivPtr priv = SpitfireGetGCPriv(pGC);
+    PixmapPtr pPixmap = NULL;
+    BoxRec bounds;
+    int dx, dy;
+
+    /* Leaving the background alone only works out for GXcopy */
+    if (nglyph == 0 || pGC->fillStyle != FillSolid || pGC->alu != GXcopy
+        || !(pPixmap = SpitfirePrepareGlyphs(pDrawable, pGC, pGC->fgPixel,
+                                             pGC->bgPixel, nglyph, ppci,
+                                             &dx, &dy))) {
+        pGC->ops = priv->wrapOps;
+        (*pGC->ops->PolyGlyphBlt)(pDrawable, pGC, x, y, nglyph, ppci, pglyphBase);
+        pGC->ops = &priv->ops;
+        return;
+    }
+
+    bounds.x1 = bounds.y1 = MAXSHORT;
+    bounds.x2 = bounds.y2 = MINSHORT;
+    SpitfireGlyphRun(pdrv, pGC, x + pDrawable->x, y + pDrawable->y,
+                     nglyph, ppci, dx, dy, &bounds);
+
+    SpitfireDoneGCDraw(pDrawable, pGC, pPixmap,
+                       bounds.x1, bounds.y1, bounds.x2, bounds.y2);
+}
+
+/* Image text always fills the font ascent and descent along the run with the
+   background, and then draws the glyphs over it, both with GXcopy */
+static void
+SpitfireImageGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                      unsigned int nglyph, CharInfoPtr *ppci, pointer pglyphBase)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDrawable->pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    SpitfireGCPrivPtr priv = SpitfireGetGCPriv(pGC);
+    RegionPtr pClip = pGC->pCompositeClip;
+    PixmapPtr pPixmap = NULL;
+    BoxRec bounds;
+    unsigned int i;
+    int dx, dy, bx, by, w, h, n, j;
+
+    if (nglyph == 0
+        || !(pPixmap = SpitfirePrepareGlyphs(pDrawable, pGC, pGC->fgPixel,
+                                             pGC->bgPixel, nglyph, ppci,
+                                             &dx, &dy))) {
+        pGC->ops = priv->wrapOps;
+        (*pGC->ops->ImageGlyphBlt)(pDrawable, pGC, x, y, nglyph, ppci, pglyphBase);
+        pGC->ops = &priv->ops;
+        return;
+    }
+
+    x += pDrawable->x;
+    y += pDrawable->y;
+
+    for (w = 0, i = 0; i < nglyph; i++)
+        w += ppci[i]->metrics.characterWidth;
+    bx = x;
+    if (w < 0) {
+        bx += w;
+        w = -w;
+    }
+    by = y - FONTASCENT(pGC->font);
+    h = FONTASCENT(pGC->font) + FONTDESCENT(pGC->font);
+
+    bounds.x1 = bx;
+    bounds.y1 = by;
+    bounds.x2 = bx + w - 1;
+    bounds.y2 = by + h - 1;
+
+    /* Background from the blank row of the atlas, a band at a time */
+    for (; h > 0; h -= n, by += n) {
+        n = min(h, SPITFIRE_GLYPH_SIZE);
+        for (j = 0; j < w; j += SPITFIRE_GLYPH_PITCH * 8)
+            SpitfireGlyphBlit(pdrv, SPITFIRE_CMD_TEXT_BITBLT
+                | SPITFIRE_SRC_PIXMAP_A
+                | SPITFIRE_PAT_PIXMAP_B
+                | SPITFIRE_DST_PIXMAP_C
+                | SPITFIRE_FORE_SRC_FGCOLOR
+                | SPITFIRE_BACK_SRC_BGCOLOR,
+                RegionRects(pClip), RegionNumRects(pClip),
+                bx + j, by, min(w - j, SPITFIRE_GLYPH_PITCH * 8), n,
+                0, 0, dx, dy);
+    }
+
+    SpitfireGlyphRun(pdrv, pGC, x, y, nglyph, ppci, dx, dy, &bounds);
+
+    SpitfireDoneGCDraw(pDrawable, pGC, pPixmap,
+                       bounds.x1, bounds.y1, bounds.x2, bounds.y2);
+}
+
+/* Stipples are expanded into offscreen memory as 1bpp pixmaps, replicated
+   in both directions so that each blit of a stippled fill covers several
+   periods of the stipple. The cache entries keep a copy of the stipple they
+   were made from, since its contents can change without the GC noticing. */
+#define SPITFIRE_STIPPLE_SPAN       256     /* Width to replicate to, pixels */
+#define SPITFIRE_STIPPLE_LINES      64      /* Height to replicate to */
+#define SPITFIRE_STIPPLE_MAX_BYTES  (128 * 1024)
+
+/* EXA is taking an expanded stipple away to make room for something else */
+static void
+SpitfireStippleSave(ScreenPtr pScreen, ExaOffscreenArea *area)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    int i;
+
+    for (i = 0; i < SPITFIRE_STIPPLE_CACHE_SIZE; i++) {
+        if (pdrv->StippleCache[i].area == area) {
+            pdrv->StippleCache[i].area = NULL;
+            SpitfireFreeSeq(pdrv, pdrv->StippleCache[i].seq);
+        }
+    }
+}
+
+/* Find the stipple in the cache, expanding it into the least recently used
+   entry if it is not there yet. Returns NULL if it cannot be expanded. */
+static SpitfireStipplePtr
+SpitfireStippleLookup(ScreenPtr pScreen, SpitfirePtr pdrv, PixmapPtr pStipple)
+{
+    int w = pStipple->drawable.width;
+    int h = pStipple->drawable.height;
+    int stride = pStipple->devKind;
+    const unsigned char *src = pStipple->devPrivate.ptr;
+    SpitfireStipplePtr entry, victim = NULL;
+    unsigned char *buf, *row;
+    int i, n, x, y, nx, ny, pitch;
+
+    for (i = 0; i < SPITFIRE_STIPPLE_CACHE_SIZE; i++) {
+        entry = &pdrv->StippleCache[i];
+        if (entry->area && entry->width == w && entry->height == h
+            && entry->stride == stride && !memcmp(entry->bits, src, h * stride)) {
+            entry->lastUse = ++pdrv->StippleUses;
+            return entry;
+        }
+        if (!victim || (victim->area && (!entry->area 
+                        || (INT32)(entry->lastUse - victim->lastUse) < 0)))
+            victim = entry;
+    }
+
+    /* At least two periods each way, so that no blit is cut short to less
+       than a whole period */
+    nx = min(SPITFIRE_STIPPLE_SPAN / w + 2, 4096 / w);
+    ny = min(SPITFIRE_STIPPLE_LINES / h + 2, 4096 / h);
+    pitch = ((nx * w + 31) >> 5) << 2;
+    if (pitch * ny * h > SPITFIRE_STIPPLE_MAX_BYTES)
+        return NULL;
+
+    if (victim->area) {
+        SpitfireWaitSeq(pdrv, victim->seq);
+        exaOffscreenFree(pScreen, victim->area);
+        victim->area = NULL;
+    }
+    free(victim->bits);
+    if (!(victim->bits = malloc(h * stride)))
+        return NULL;
+    if (!(buf = calloc(ny * h, pitch))) {
+        free(victim->bits);
+        victim->bits = NULL;
+        return NULL;
+    }
+
+    /* Replicate the stipple across its first period of lines, bit by bit, and
+       then down by doubling the lines already there */
+    for (y = 0; y < h; y++) {
+        row = buf + y * pitch;
+        for (x = 0; x < nx * w; x++)
+            if (src[y * stride + ((x % w) >> 3)] & (1 << ((x % w) & 7)))
+                row[x >> 3] |= 1 << (x & 7);
+    }
+    for (y = h; y < ny * h; y += n) {
+        n = min(y, ny * h - y);
+        memcpy(buf + y * pitch, buf, n * pitch);
+    }
+
+    victim->area = exaOffscreenAlloc(pScreen, pitch * ny * h, 64, FALSE,
+                                     SpitfireStippleSave, NULL);
+    if (victim->area) {
+        SpitfireWaitSeq(pdrv, pdrv->FreedSeq);
+        pdrv->UploadCopy(pdrv->EXADriverPtr->memoryBase + victim->area->offset,
+                         pitch, buf, pitch, pitch, ny * h);
+    }
+    free(buf);
+    if (!victim->area)
+        return NULL;
+
+    memcpy(victim->bits, src, h * stride);
+    victim->width = w;
+    victim->height = h;
+    victim->stride = stride;
+    victim->repWidth = nx * w;
+    victim->repHeight = ny * h;
+    victim->pitch = pitch;
+    victim->seq = 0;
+    victim->lastUse = ++pdrv->StippleUses;
+    return victim;
+}
+
+/* Get the engine ready to fill with the stipple of pGC into pDrawable. 
+   Returns the pixmap to draw into as SpitfireGetDrawingPixmap does. */
+static PixmapPtr
+SpitfirePrepareStipple(DrawablePtr pDrawable, GCPtr pGC,
+                       SpitfireStipplePtr *pEntry, int *dx, int *dy)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    SpitfirePtr pdrv = DEVPTR(xf86ScreenToScrn(pScreen));
+    SpitfireStipplePtr entry;
+    PixmapPtr pPixmap;
+    unsigned int cmd;
+
+    /* Bringing in the pixmap may push the stipple out again */
+    if (!(entry = SpitfireStippleLookup(pScreen, pdrv, pGC->stipple))
+        || !(pPixmap = SpitfireGetDrawingPixmap(pDrawable, dx, dy))
+        || !entry->area)
+        return NULL;
+
+    cmd = SPITFIRE_CMD_BITBLT
+        | SPITFIRE_SRC_PIXMAP_A
+        | SPITFIRE_PAT_PIXMAP_B
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_FGCOLOR
+        | ((pGC->fillStyle == FillOpaqueStippled)
+            ? SPITFIRE_BACK_SRC_BGCOLOR
+            : SPITFIRE_BACK_SRC_PIXMAP); /* Source is the destination, a noop */
+
+    SpitfireSetColors(pdrv, pGC->fgPixel, pGC->bgPixel);
+    SpitfireSetPixelBitmask(pdrv, pGC->planemask);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, SpitfireGetCopyROP(pGC->alu));
+
+    SpitfireEXASetupPixmap(pdrv, pPixmap, SPITFIRE_INDEX_PIXMAP_A);
+    SpitfireEXASetupPixmap(pdrv, pPixmap, SPITFIRE_INDEX_PIXMAP_C);
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_B,
+        entry->area->offset, entry->pitch * 8 - 1, entry->repHeight - 1,
+        SPITFIRE_FORMAT_1BPP | SPITFIRE_FORMAT_INTEL);
+
+    pdrv->SavedAccelCmd = cmd;
+    *pEntry = entry;
+    return pPixmap;
+}
+
+/* Fill a box in screen coordinates with the stipple, which has its origin
+   at (ox, oy). Each blit starts somewhere within the first period of the
+   replicated stipple and runs as far as the replicated copy allows. */
+static void
+SpitfireStippleBox(SpitfirePtr pdrv, SpitfireStipplePtr entry,
+                   int x1, int y1, int x2, int y2, int ox, int oy,
+                   int dx, int dy)
+{
+    int x, y, w, h, px, py;
+
+    for (y = y1; y < y2; y += h) {
+        py = (y - oy) % entry->height;
+        if (py < 0)
+            py += entry->height;
+        h = min(y2 - y, entry->repHeight - py);
+
+        for (x = x1; x < x2; x += w) {
+            px = (x - ox) % entry->width;
+            if (px < 0)
+                px += entry->width;
+            w = min(x2 - x, entry->repWidth - px);
+
+            SpitfireWaitCmdSlot(pdrv);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, w - 1, h - 1);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, x + dx, y + dy);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_PAT, px, py);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x + dx, y + dy);
+            SpitfireKickCmd(pdrv, pdrv->SavedAccelCmd);
+        }
+    }
+}
+
+/* EXA is taking the packed tile away to make room for something else */
+static void
+SpitfirePatternSave(ScreenPtr pScreen, ExaOffscreenArea *area)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    if (pdrv->PatternArea == area) {
+        pdrv->PatternArea = NULL;
+        SpitfireFreeSeq(pdrv, pdrv->SubmitSeq);
+    }
+}
+
+/* Get the engine ready to fill with the 8x8 tile of pGC into pDrawable.
+   EXA pads the pitch of the tile, so it is first packed into an area of its
+   own width, from which the engine repeats it. Returns the pixmap to draw
+   into as SpitfireGetDrawingPixmap does. */
+static PixmapPtr
+SpitfirePrepareTile(DrawablePtr pDrawable, GCPtr pGC, int *dx, int *dy)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    SpitfirePtr pdrv = DEVPTR(xf86ScreenToScrn(pScreen));
+    PixmapPtr pTile = pGC->tile.pixmap;
+    PixmapPtr pPixmap;
+    unsigned int format = SpitfireBppFormat[pTile->drawable.bitsPerPixel >> 3];
+
+    if (!pdrv->PatternArea)
+        pdrv->PatternArea = exaOffscreenAlloc(pScreen, 8 * 8 * 4, 64, FALSE,
+                                              SpitfirePatternSave, NULL);
+    if (!pdrv->PatternArea)
+        return NULL;
+
+    /* Each migration may push out what the others brought in */
+    exaMoveInPixmap(pTile);
+    if (!(pPixmap = SpitfireGetDrawingPixmap(pDrawable, dx, dy))
+        || !exaDrawableIsOffscreen(&pTile->drawable)
+        || !pdrv->PatternArea)
+        return NULL;
+
+    SpitfireSetPixelBitmask(pdrv, ~0);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, 0xCC); /* GXcopy */
+    SpitfireEXASetupPixmap(pdrv, pTile, SPITFIRE_INDEX_PIXMAP_A);
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_C,
+        pdrv->PatternArea->offset, 8 - 1, 8 - 1, format);
+
+    SpitfireWaitCmdSlot(pdrv);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, 8 - 1, 8 - 1);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, 0, 0);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, 0, 0);
+    SpitfireKickCmd(pdrv, SPITFIRE_CMD_BITBLT
+        | SPITFIRE_SRC_PIXMAP_A
+        | SPITFIRE_PAT_FOREGROUND
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_PIXMAP
+        | SPITFIRE_BACK_SRC_PIXMAP);
+    SpitfireMarkPixmap(pdrv, pTile, FALSE);
+
+    SpitfireSetPixelBitmask(pdrv, pGC->planemask);
+    SpitfireSetRopMix(pdrv, SpitfireGetCopyROP(pGC->alu));
+    SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_B,
+        pdrv->PatternArea->offset, 8 - 1, 8 - 1, format);
+    SpitfireEXASetupPixmap(pdrv, pPixmap, SPITFIRE_INDEX_PIXMAP_C);
+
+    /* The packed tile is both source and pattern of the fill */
+    pdrv->SavedAccelCmd = SPITFIRE_CMD_PATTERN_COPY
+        | SPITFIRE_SRC_PIXMAP_B
+        | SPITFIRE_PAT_PIXMAP_B
+        | SPITFIRE_DST_PIXMAP_C
+        | SPITFIRE_FORE_SRC_PIXMAP
+        | SPITFIRE_BACK_SRC_PIXMAP;
+    return pPixmap;
+}
+
+/* Fill a box in screen coordinates with the packed tile, which has its
+   origin at (ox, oy). The engine repeats the tile by itself. */
+static void
+SpitfireTileBox(SpitfirePtr pdrv, int x1, int y1, int x2, int y2,
+                int ox, int oy, int dx, int dy)
+{
+    int px = (x1 - ox) & 7;
+    int py = (y1 - oy) & 7;
+
+    SpitfireWaitCmdSlot(pdrv);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, x2 - x1 - 1, y2 - y1 - 1);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, px, py);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_PAT, px, py);
+    SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x1 + dx, y1 + dy);
+    SpitfireKickCmd(pdrv, pdrv->SavedAccelCmd);
+}
+
+static void
+SpitfirePolyFillRect(DrawablePtr pDrawable, GCPtr pGC, int nrect,
+                     xRectangle *prect)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDrawable->pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    SpitfireGCPrivPtr priv = SpitfireGetGCPriv(pGC);
+    RegionPtr pClip = pGC->pCompositeClip;
+    SpitfireStipplePtr entry = NULL;
+    PixmapPtr pPixmap = NULL;
+    BoxPtr pBox;
+    int nBox, x1, y1, x2, y2, ox, oy, dx, dy;
+    int minX, minY, maxX, maxY;
+
+    /* Stipples are only taken over while they live in system memory */
+    if (nrect > 0) {
+        if (pGC->fillStyle == FillTiled)
+            pPixmap = SpitfirePrepareTile(pDrawable, pGC, &dx, &dy);
+        else if (!exaDrawableIsOffscreen(&pGC->stipple->drawable))
+            pPixmap = SpitfirePrepareStipple(pDrawable, pGC, &entry, &dx, &dy);
+    }
+    if (!pPixmap) {
+        pGC->ops = priv->wrapOps;
+        (*pGC->ops->PolyFillRect)(pDrawable, pGC, nrect, prect);
+        pGC->ops = &priv->ops;
+        return;
+    }
+
+    ox = pDrawable->x + pGC->patOrg.x;
+    oy = pDrawable->y + pGC->patOrg.y;
+
+    minX = minY = MAXSHORT;
+    maxX = maxY = MINSHORT;
+    for (; nrect > 0; nrect--, prect++) {
+        x1 = prect->x + pDrawable->x;
+        y1 = prect->y + pDrawable->y;
+        x2 = x1 + prect->width;
+        y2 = y1 + prect->height;
+        if (x1 >= x2 || y1 >= y2)
+            continue;
+
+        for (pBox = RegionRects(pClip), nBox = RegionNumRects(pClip);
+             nBox > 0; nBox--, pBox++) {
+            if (max(x1, pBox->x1) >= min(x2, pBox->x2)
+                || max(y1, pBox->y1) >= min(y2, pBox->y2))
+                continue;
+            if (entry)
+                SpitfireStippleBox(pdrv, entry,
+                                   max(x1, pBox->x1), max(y1, pBox->y1),
+                                   min(x2, pBox->x2), min(y2, pBox->y2),
+                                   ox, oy, dx, dy);
+            else
+                SpitfireTileBox(pdrv,
+                                max(x1, pBox->x1), max(y1, pBox->y1),
+                                min(x2, pBox->x2), min(y2, pBox->y2),
+                                ox, oy, dx, dy);
+        }
+
+        minX = min(minX, x1); maxX = max(maxX, x2 - 1);
+        minY = min(minY, y1); maxY = max(maxY, y2 - 1);
+    }
+    if (entry)
+        entry->seq = pdrv->SubmitSeq;
+
+    SpitfireDoneGCDraw(pDrawable, pGC, pPixmap, minX, minY, maxX, maxY);
+}
+
+/* Only solid zero-width lines, with every plane enabled, are drawn by the
+   engine, and only into pixmaps that it can address by whole pixels. */
+static Bool
+SpitfireGCLinesOK(GCPtr pGC, DrawablePtr pDrawable)
+{
+    unsigned long full = FbFullMask(pDrawable->depth);
+
+    return pGC->lineWidth == 0
+        && pGC->lineStyle == LineSolid
+        && pGC->fillStyle == FillSolid
+        && (pGC->planemask & full) == full
+        && pDrawable->bitsPerPixel >= 8
+        && pDrawable->bitsPerPixel != 24;
+}
+
+/* Text goes through the glyph atlas when every plane is enabled, into pixmaps
+   the engine can address by whole pixels. Glyph bits are copied into the
+   atlas as they are, so they have to be in the bit order of the engine. Fill
+   style and raster op are checked as each run is drawn, image text ignores
+   them. */
+static Bool
+SpitfireGCTextOK(GCPtr pGC, DrawablePtr pDrawable)
+{
+#if BITMAP_BIT_ORDER == LSBFirst
+    unsigned long full = FbFullMask(pDrawable->depth);
+
+    return (pGC->planemask & full) == full
+        && pDrawable->bitsPerPixel >= 8
+        && pDrawable->bitsPerPixel != 24;
+#else
+    return FALSE;
+#endif
+}
+
+/* Stippled fills are expanded from a copy of the stipple in offscreen
+   memory. Like glyphs, the stipple bits are used as they are. A transparent
+   stipple leaves the background alone only with GXcopy. */
+static Bool
+SpitfireGCStippleOK(GCPtr pGC, DrawablePtr pDrawable)
+{
+#if BITMAP_BIT_ORDER == LSBFirst
+    return ((pGC->fillStyle == FillStippled && pGC->alu == GXcopy)
+            || pGC->fillStyle == FillOpaqueStippled)
+        && pGC->stipple
+        && pGC->stipple->drawable.width <= 4096
+        && pGC->stipple->drawable.height <= 4096
+        && pDrawable->bitsPerPixel >= 8
+        && pDrawable->bitsPerPixel != 24;
+#else
+    return FALSE;
+#endif
+}
+
+/* Only 8x8 tiles of the depth of the destination are filled by the engine,
+   which repeats them by itself. Larger tiles are left to EXA, which copies
+   them with the engine. */
+static Bool
+SpitfireGCTileOK(GCPtr pGC, DrawablePtr pDrawable)
+{
+    return pGC->fillStyle == FillTiled
+        && !pGC->tileIsPixel
+        && pGC->tile.pixmap->drawable.width == 8
+        && pGC->tile.pixmap->drawable.height == 8
+        && pGC->tile.pixmap->drawable.bitsPerPixel == pDrawable->bitsPerPixel
+        && pDrawable->bitsPerPixel >= 8
+        && pDrawable->bitsPerPixel != 24;
+}
+
+/* Put our ops in front of the ones the layer below has just installed */
+static void
+SpitfireWrapGCOps(GCPtr pGC, SpitfireGCPrivPtr priv)
+{
+    priv->wrapOps = pGC->ops;
+    priv->ops = *pGC->ops;
+    if (priv->drawLines) {
+        priv->ops.Polylines = SpitfirePolylines;
+        priv->ops.PolySegment = SpitfirePolySegment;
+    }
+    if (priv->drawText) {
+        priv->ops.PolyGlyphBlt = SpitfirePolyGlyphBlt;
+        priv->ops.ImageGlyphBlt = SpitfireImageGlyphBlt;
+    }
+    if (priv->drawFill)
+        priv->ops.PolyFillRect = SpitfirePolyFillRect;
+    pGC->ops = &priv->ops;
+}
+
+static void SpitfireValidateGC(GCPtr pGC, unsigned long changes, DrawablePtr pDrawable);
+static void SpitfireChangeGC(GCPtr pGC, unsigned long mask);
+static void SpitfireCopyGC(GCPtr pGCSrc, unsigned long mask, GCPtr pGCDst);
+static void SpitfireDestroyGC(GCPtr pGC);
+static void SpitfireChangeClip(GCPtr pGC, int type, pointer pvalue, int nrects);
+static void SpitfireDestroyClip(GCPtr pGC);
+static void SpitfireCopyClip(GCPtr pgcDst, GCPtr pgcSrc);
+
+static const GCFuncs SpitfireGCFuncs = {
+    SpitfireValidateGC,
+    SpitfireChangeGC,
+    SpitfireCopyGC,
+    SpitfireDestroyGC,
+    SpitfireChangeClip,
+    SpitfireDestroyClip,
+    SpitfireCopyClip
+};
+
+/* Restore the funcs and ops of the layer below around a call into it */
+#define SPITFIRE_GC_FUNC_PROLOGUE(pGC)                                      \
+    SpitfireGCPrivPtr priv = SpitfireGetGCPriv(pGC);                        \
+    (pGC)->funcs = priv->wrapFuncs;                                         \
+    if (priv->wrapOps)                                                      \
+        (pGC)->ops = priv->wrapOps
+
+#define SPITFIRE_GC_FUNC_EPILOGUE(pGC)                                      \
+    priv->wrapFuncs = (pGC)->funcs;                                         \
+    (pGC)->funcs = &SpitfireGCFuncs;                                        \
+    if (priv->wrapOps)                                                      \
+        SpitfireWrapGCOps(pGC, priv)
+
+static void
+SpitfireValidateGC(GCPtr pGC, unsigned long changes, DrawablePtr pDrawable)
+{
+    SPITFIRE_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->ValidateGC)(pGC, changes, pDrawable);
+    priv->wrapOps = NULL;
+    priv->drawLines = SpitfireGCLinesOK(pGC, pDrawable);
+    priv->drawText = SpitfireGCTextOK(pGC, pDrawable);
+    priv->drawFill = SpitfireGCStippleOK(pGC, pDrawable)
+                  || SpitfireGCTileOK(pGC, pDrawable);
+    if (priv->drawLines || priv->drawText || priv->drawFill)
+        priv->wrapOps = pGC->ops;
+    SPITFIRE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+SpitfireChangeGC(GCPtr pGC, unsigned long mask)
+{
+    SPITFIRE_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->ChangeGC)(pGC, mask);
+    SPITFIRE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+SpitfireCopyGC(GCPtr pGCSrc, unsigned long mask, GCPtr pGCDst)
+{
+    SPITFIRE_GC_FUNC_PROLOGUE(pGCDst);
+    (*pGCDst->funcs->CopyGC)(pGCSrc, mask, pGCDst);
+    SPITFIRE_GC_FUNC_EPILOGUE(pGCDst);
+}
+
+static void
+SpitfireDestroyGC(GCPtr pGC)
+{
+    SPITFIRE_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->DestroyGC)(pGC);
+    priv->wrapOps = NULL;
+}
+
+static void
+SpitfireChangeClip(GCPtr pGC, int type, pointer pvalue, int nrects)
+{
+    SPITFIRE_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->ChangeClip)(pGC, type, pvalue, nrects);
+    SPITFIRE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+SpitfireDestroyClip(GCPtr pGC)
+{
+    SPITFIRE_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->DestroyClip)(pGC);
+    SPITFIRE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+SpitfireCopyClip(GCPtr pgcDst, GCPtr pgcSrc)
+{
+    SPITFIRE_GC_FUNC_PROLOGUE(pgcDst);
+    (*pgcDst->funcs->CopyClip)(pgcDst, pgcSrc);
+    SPITFIRE_GC_FUNC_EPILOGUE(pgcDst);
+}
+
+static Bool
+SpitfireCreateGC(GCPtr pGC)
+{
+    ScreenPtr pScreen = pGC->pScreen;
+    SpitfirePtr pdrv = DEVPTR(xf86ScreenToScrn(pScreen));
+    SpitfireGCPrivPtr priv = SpitfireGetGCPriv(pGC);
+    Bool ret;
+
+    pScreen->CreateGC = pdrv->CreateGC;
+    ret = (*pScreen->CreateGC)(pGC);
+    pScreen->CreateGC = SpitfireCreateGC;
+
+    if (ret) {
+        priv->wrapFuncs = pGC->funcs;
+        priv->wrapOps = NULL;
+        pGC->funcs = &SpitfireGCFuncs;
+    }
+    return ret;
+}
+
+#ifdef SPITFIRE_MASKED_COPY
+/* RENDER composites of an opaque source through an a1 mask, as drawn for
+   icons and by shaped clients, are copies that the engine can mask with a
+   1bpp pixmap (SPITFIRE_MASK_MAP), drawing only where its bits are set. EXA
+   keeps pixmaps of less than 8bpp in system memory, and falls back whenever
+   one is part of a composite, so these are caught above EXA. The bits of the
+   mask are uploaded into a strip of video memory a few lines at a time, into
+   either half of it in turn, so that the CPU fills one while the engine reads
+   the other. */
+
+static void
+SpitfireMaskSave(ScreenPtr pScreen, ExaOffscreenArea *area)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    if (pdrv->MaskArea == area) {
+        pdrv->MaskArea = NULL;
+        SpitfireFreeSeq(pdrv, pdrv->MaskSeq[0]);
+        SpitfireFreeSeq(pdrv, pdrv->MaskSeq[1]);
+    }
+}
+
+/* A picture sampled 1:1 from its drawable */
+static Bool
+SpitfirePlainPicture(PicturePtr pPict)
+{
+    return pPict->pDrawable && !pPict->repeat && !pPict->transform
+        && !pPict->alphaMap;
+}
+
+/* Src or Over of a source in the format of the destination, which has no
+   alpha, through an a1 mask. Not in 24 bpp, where the engine would apply the
+   mask to bytes. */
+static Bool
+SpitfireIsMaskedCopy(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst)
+{
+    if ((op != PictOpSrc && op != PictOpOver) || !pMask)
+        return FALSE;
+    if (!SpitfirePlainPicture(pSrc) || !SpitfirePlainPicture(pMask)
+        || pDst->alphaMap)
+        return FALSE;
+    if (pMask->format != PICT_a1 || pMask->componentAlpha
+        || pMask->pDrawable->type != DRAWABLE_PIXMAP)
+        return FALSE;
+    return pSrc->format == pDst->format && !PICT_FORMAT_A(pDst->format)
+        && pDst->pDrawable->bitsPerPixel != 24;
+}
+
+/* Copy n lines of w bits from (mx, my) in the mask to the start of the lines
+   of a strip */
+static void
+SpitfireMaskUpload(unsigned char *strip, PixmapPtr pMask,
+                   int mx, int my, int w, int n)
+{
+    int stride = pMask->devKind;
+    const unsigned char *src = (const unsigned char *)pMask->devPrivate.ptr
+        + my * stride + (mx >> 3);
+    int shift = mx & 7;
+    int bytes = (w + 7) >> 3;
+    int last = ((mx + w - 1) >> 3) - (mx >> 3);
+    int i;
+
+    for (; n--; src += stride, strip += SPITFIRE_MASK_PITCH)
+        for (i = 0; i < bytes; i++)
+            strip[i] = (src[i] >> shift)
+                | (i < last ? src[i + 1] << (8 - shift) : 0);
+}
+
+/* Draw a masked copy. Returns FALSE, having drawn nothing, if the pixmaps or
+   the strip cannot be had in video memory. */
+static Bool
+SpitfireMaskedCopy(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+                   INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask,
+                   INT16 xDst, INT16 yDst, CARD16 width, CARD16 height)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    SpitfirePtr pdrv = DEVPTR(xf86ScreenToScrn(pScreen));
+    PixmapPtr pMaskPix = (PixmapPtr)pMask->pDrawable;
+    PixmapPtr pSrcPix, pDstPix;
+    DrawablePtr pSrcDraw = pSrc->pDrawable;
+    RegionRec region;
+    BoxRec bounds;
+    BoxPtr pBox;
+    CARD32 strip;
+    int nBox, sdx, sdy, ddx, ddy, x1, y1, x2, y2, y, n;
+
+    if (exaDrawableIsOffscreen(&pMaskPix->drawable))
+        return FALSE;
+    if (!pdrv->MaskArea) {
+        pdrv->MaskArea = exaOffscreenAlloc(pScreen,
+            2 * SPITFIRE_MASK_LINES * SPITFIRE_MASK_PITCH, 64, FALSE,
+            SpitfireMaskSave, NULL);
+        pdrv->MaskSeq[0] = pdrv->MaskSeq[1] = pdrv->FreedSeq;
+    }
+    if (!pdrv->MaskArea)
+        return FALSE;
+
+    /* Each migration may push out what the others brought in */
+    if (!(pDstPix = SpitfireGetDrawingPixmap(pDst->pDrawable, &ddx, &ddy))
+        || !(pSrcPix = SpitfireGetDrawingPixmap(pSrcDraw, &sdx, &sdy))
+        || !exaDrawableIsOffscreen(pDst->pDrawable)
+        || pSrcPix == pDstPix || !pdrv->MaskArea)
+        return FALSE;
+
+    xDst += pDst->pDrawable->x;
+    yDst += pDst->pDrawable->y;
+    xSrc += pSrcDraw->x;
+    ySrc += pSrcDraw->y;
+    if (!miComputeCompositeRegion(&region, pSrc, pMask, pDst, xSrc, ySrc,
+                                  xMask, yMask, xDst, yDst, width, height))
+        return TRUE;
+
+    /* Outside of the source and the mask, nothing is copied */
+    bounds.x1 = max(pSrcDraw->x - xSrc, -xMask) + xDst;
+    bounds.y1 = max(pSrcDraw->y - ySrc, -yMask) + yDst;
+    bounds.x2 = min(pSrcDraw->x + pSrcDraw->width - xSrc,
+                    pMaskPix->drawable.width - xMask) + xDst;
+    bounds.y2 = min(pSrcDraw->y + pSrcDraw->height - ySrc,
+                    pMaskPix->drawable.height - yMask) + yDst;
+
+    SpitfireSetPixelBitmask(pdrv, ~0);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, 0xCC); /* GXcopy */
+    SpitfireEXASetupPixmap(pdrv, pDstPix, SPITFIRE_INDEX_PIXMAP_C);
+
+    /* Src leaves zero wherever the mask does not let the source through */
+    if (op == PictOpSrc) {
+        SpitfireSetColors(pdrv, 0, 0);
+        nBox = RegionNumRects(&region);
+        for (pBox = RegionRects(&region); nBox--; pBox++) {
+            SpitfireWaitCmdSlot(pdrv);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1,
+                pBox->x2 - pBox->x1 - 1, pBox->y2 - pBox->y1 - 1);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC,
+                pBox->x1 + ddx, pBox->y1 + ddy);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST,
+                pBox->x1 + ddx, pBox->y1 + ddy);
+            SpitfireKickCmd(pdrv, SPITFIRE_CMD_FILL
+                | SPITFIRE_PAT_FOREGROUND
+                | SPITFIRE_DST_PIXMAP_C
+                | SPITFIRE_FORE_SRC_FGCOLOR
+                | SPITFIRE_BACK_SRC_BGCOLOR);
+        }
+    }
+
+    SpitfireEXASetupPixmap(pdrv, pSrcPix, SPITFIRE_INDEX_PIXMAP_A);
+    nBox = RegionNumRects(&region);
+    for (pBox = RegionRects(&region); nBox--; pBox++) {
+        x1 = max(pBox->x1, bounds.x1);
+        y1 = max(pBox->y1, bounds.y1);
+        x2 = min(pBox->x2, bounds.x2);
+        y2 = min(pBox->y2, bounds.y2);
+        if (x1 >= x2 || y1 >= y2)
+            continue;
+
+        for (y = y1; y < y2; y += n) {
+            n = min(y2 - y, SPITFIRE_MASK_LINES);
+            pdrv->MaskHalf ^= 1;
+            strip = pdrv->MaskArea->offset
+                + pdrv->MaskHalf * SPITFIRE_MASK_LINES * SPITFIRE_MASK_PITCH;
+
+            SpitfireWaitSeq(pdrv, pdrv->MaskSeq[pdrv->MaskHalf]);
+            SpitfireMaskUpload(pdrv->EXADriverPtr->memoryBase + strip, pMaskPix,
+                               x1 - xDst + xMask, y - yDst + yMask, x2 - x1, n);
+
+            /* The mask map is placed over the blit in the destination */
+            SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_MASK, strip,
+                SPITFIRE_MASK_PITCH * 8 - 1, n - 1,
+                SPITFIRE_FORMAT_1BPP | SPITFIRE_FORMAT_INTEL);
+            SpitfireSetMaskOrigin(pdrv, x1 + ddx, y + ddy);
+
+            SpitfireWaitCmdSlot(pdrv);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, x2 - x1 - 1, n - 1);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC,
+                x1 - xDst + xSrc + sdx, y - yDst + ySrc + sdy);
+            SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, x1 + ddx, y + ddy);
+            SpitfireKickCmd(pdrv, SPITFIRE_CMD_BITBLT
+                | SPITFIRE_SRC_PIXMAP_A
+                | SPITFIRE_PAT_FOREGROUND
+                | SPITFIRE_DST_PIXMAP_C
+                | SPITFIRE_FORE_SRC_PIXMAP
+                | SPITFIRE_BACK_SRC_PIXMAP
+                | SPITFIRE_MASK_MAP);
+            pdrv->MaskSeq[pdrv->MaskHalf] = pdrv->SubmitSeq;
+        }
+    }
+
+    SpitfireMarkPixmap(pdrv, pSrcPix, FALSE);
+    SpitfireMarkPixmap(pdrv, pDstPix, TRUE);
+    exaMarkSync(pScreen);
+    DamageRegionAppend(pDst->pDrawable, &region);
+    DamageRegionProcessPending(pDst->pDrawable);
+    RegionUninit(&region);
+    return TRUE;
+}
+
+static void
+SpitfireComposite(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+                  INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask,
+                  INT16 xDst, INT16 yDst, CARD16 width, CARD16 height)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    SpitfirePtr pdrv = DEVPTR(xf86ScreenToScrn(pScreen));
+
+    if (SpitfireIsMaskedCopy(op, pSrc, pMask, pDst)
+        && SpitfireMaskedCopy(op, pSrc, pMask, pDst, xSrc, ySrc,
+                              xMask, yMask, xDst, yDst, width, height))
+        return;
+
+    ps->Composite = pdrv->Composite;
+    (*ps->Composite)(op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask,
+                     xDst, yDst, width, height);
+    ps->Composite = SpitfireComposite;
+}
+#endif
+
+/* Size of the offscreen area used to pack rectangles being read back */
+#define SPITFIRE_STAGING_SIZE   (64 * 1024)
+
+/* EXA is taking the staging area away to make room for something else */
+static void
+SpitfireStagingSave(ScreenPtr pScreen, ExaOffscreenArea *area)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+
+    if (pdrv->StagingArea == area) {
+        pdrv->StagingArea = NULL;
+        SpitfireFreeSeq(pdrv, pdrv->SubmitSeq);
+    }
+}
+
+/* Read back a rectangle of a pixmap into system memory. Reads from the 
+   framebuffer are uncached and each one is a PCI transaction, so unless the
+   rectangle is already contiguous in video memory, the engine first packs it
+   into a staging area, which the CPU then reads sequentially with the 
+   widest loads available. */
+static Bool
+SpitfireDownloadFromScreen(PixmapPtr pSrc, int x, int y, int w, int h,
+                           char *dst, int dst_pitch)
+{
+    ScreenPtr pScreen = pSrc->drawable.pScreen;
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    SpitfirePtr pdrv = DEVPTR(pScrn);
+    int bpp = pSrc->drawable.bitsPerPixel;
+    int Bpp = bpp >> 3;
+    int xscale = (bpp == 24) ? 3 : 1;
+    int src_pitch = exaGetPixmapPitch(pSrc);
+    unsigned char *src = pdrv->EXADriverPtr->memoryBase + exaGetPixmapOffset(pSrc);
+    unsigned char *stage;
+    int wBytes = w * Bpp;
+    int stage_pitch = (wBytes + 3) & ~3;    /* Pixmap width is DWORD aligned */
+    int stage_width = stage_pitch >> SpitfireBppShift[bpp >> 3];
+    int rows, n;
+
+    if (bpp < 8)
+        return FALSE;
+
+    /* Pending engine writes to the pixmap must land before it is read. EXA
+       also reads pixmaps back when evicting them, and the commands still
+       reading this one may then outlive its memory. */
+    SpitfireWaitSeq(pdrv, SpitfirePixmapSeq(pdrv, pSrc, FALSE));
+    if (SpitfireGetPixmapPriv(pSrc)->UseSeq)
+        SpitfireFreeSeq(pdrv, SpitfireGetPixmapPriv(pSrc)->UseSeq);
+
+    if (!pdrv->StagingArea)
+        pdrv->StagingArea = exaOffscreenAlloc(pScreen, SPITFIRE_STAGING_SIZE, 64,
+                                              FALSE, SpitfireStagingSave, NULL);
+
+    /* Read directly when the rectangle is already contiguous, when it does 
+       not fit the engine, or when there is no room for staging */
+    if (wBytes == src_pitch || h == 1
+        || stage_pitch > SPITFIRE_STAGING_SIZE || stage_width > 4096
+        || (bpp == 24 && src_pitch > 0xFFF) || y + h > 0x1000
+        || !pdrv->StagingArea || pdrv->EngineFailed) {
+        pdrv->DownloadCopy((unsigned char *)dst, dst_pitch,
+                           src + y * src_pitch + x * Bpp, src_pitch, wBytes, h);
+        return TRUE;
+    }
+
+    stage = pdrv->EXADriverPtr->memoryBase + pdrv->StagingArea->offset;
+    rows = SPITFIRE_STAGING_SIZE / stage_pitch;
+    if (rows > 4096)
+        rows = 4096;
+
+    SpitfireSetPixelBitmask(pdrv, ~0);
+    SpitfireSetColorCompare(pdrv, 0, 6); /* Always update */
+    SpitfireSetRopMix(pdrv, 0xCC); /* GXcopy */
+    SpitfireEXASetupPixmap(pdrv, pSrc, SPITFIRE_INDEX_PIXMAP_A);
+
+    for (; h > 0; h -= n, y += n, dst += n * dst_pitch) {
+        n = (h < rows) ? h : rows;
+
+        SpitfireSetupPixMap(pdrv, SPITFIRE_INDEX_PIXMAP_C,
+            pdrv->StagingArea->offset, stage_width - 1, n - 1,
+            SpitfireBppFormat[bpp >> 3]);
+
+        SpitfireWaitCmdSlot(pdrv);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OP_DIM_1, w * xscale - 1, n - 1);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_SRC, x * xscale, y);
+        SpitfireWriteRegPair(pdrv, SPITFIRE_OFFSET_X_DST, 0, 0);
+        SpitfireKickCmd(pdrv, SPITFIRE_CMD_BITBLT
+            | SPITFIRE_SRC_PIXMAP_A
+            | SPITFIRE_PAT_FOREGROUND
+            | SPITFIRE_DST_PIXMAP_C
+            | SPITFIRE_FORE_SRC_PIXMAP
+            | SPITFIRE_BACK_SRC_PIXMAP);
+        SpitfireWaitIdle(pdrv);
+
+        pdrv->DownloadCopy((unsigned char *)dst, dst_pitch,
+                           stage, stage_pitch, wBytes, n);
+    }
+    return TRUE;
+}
@@ -32,6 +32,9 @@
 #define SPITFIRE_BRESENHAM_K1   0x24
 #define SPITFIRE_BRESENHAM_K2   0x28
 #define SPITFIRE_SHORT_STROKE   0x2c
+#define     SPITFIRE_STROKE_LEN_MASK            0x0f
+#define     SPITFIRE_STROKE_DRAW                0x10
+#define     SPITFIRE_STROKE_DIR_SHIFT           5   /* In 45 degree steps, counterclockwise from +X */
 
 #define SPITFIRE_ROPMIX          0x48
 
@@ -83,13 +86,26 @@
 #define     SPITFIRE_CMD_FILL                   0x0a000000UL
 #define     SPITFIRE_CMD_TEXT_BITBLT            0x0b000000UL
 #define     SPITFIRE_CMD_PATTERN_COPY           0x0c000000UL
+#define     SPITFIRE_CMD_OPCODE_MASK            0x0f000000UL
 #define     SPITFIRE_FORE_SRC_FGCOLOR           0
 #define     SPITFIRE_FORE_SRC_PIXMAP            0x20000000UL
 #define     SPITFIRE_BACK_SRC_BGCOLOR           0
 #define     SPITFIRE_BACK_SRC_PIXMAP            0x80000000UL
 
+/* Default number of commands allowed in flight through the coprocessor
+   command buffer (OR22 bit 2). A depth of 1 waits for the engine to become
+   idle before every command. */
+#define SPITFIRE_CMD_BUFFER_DEPTH   2
+
 Bool SpitfireInitAccel(ScreenPtr pScreen);
+void SpitfireResetEngineState(ScrnInfoPtr pScrn);
+void SpitfireAccelSync(ScrnInfoPtr pScrn);
+void SpitfireDumpWaitStats(ScrnInfoPtr pScrn);
 Bool WaitIdleEmpty(ScrnInfoPtr pScrn);
 
+/* spitfire_memcpy.c */
+SpitfireCopyRectProc SpitfireSelectUploadCopy(const char **name);
+SpitfireCopyRectProc SpitfireSelectDownloadCopy(const char **name);
+
 #endif
 
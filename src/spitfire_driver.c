@@ -155,6 +155,9 @@ typedef enum {
     ,OPTION_INIT_BIOS
     ,OPTION_IGNORE_EDID
     ,OPTION_DUMP_REGS
+    ,OPTION_DUMP_WAIT_STATS
+    ,OPTION_CMD_BUFFER_DEPTH
+    ,OPTION_PACKED_MMIO
 } SpitfireOpts;
 
 
@@ -168,6 +171,9 @@ static const OptionInfoRec SpitfireOptions[] =
     { OPTION_ACCELMETHOD,   "AccelMethod",  OPTV_STRING,    {0}, FALSE },
     { OPTION_INIT_BIOS,     "InitBIOS",     OPTV_BOOLEAN,   {0}, FALSE },
     { OPTION_DUMP_REGS,     "DumpRegs",     OPTV_BOOLEAN,   {0}, FALSE },
+    { OPTION_DUMP_WAIT_STATS, "DumpWaitStats", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_CMD_BUFFER_DEPTH, "CommandBufferDepth", OPTV_INTEGER, {0}, FALSE },
+    { OPTION_PACKED_MMIO,   "PackedMMIO",   OPTV_BOOLEAN,   {0}, FALSE },
 
     { -1,                NULL,                OPTV_NONE,    {0}, FALSE }
 };
@@ -751,6 +757,22 @@ static Bool SpitfirePreInit(ScrnInfoPtr pScrn, int flags)
 #endif
        xf86DrvMsg(pScrn->scrnIndex, from, "Using %s acceleration architecture\n",
                 pdrv->useEXA ? "EXA" : "XAA");
+
+        from = X_DEFAULT;
+        pdrv->CmdBufferDepth = SPITFIRE_CMD_BUFFER_DEPTH;
+        if (xf86GetOptValInteger(pdrv->Options, OPTION_CMD_BUFFER_DEPTH, &pdrv->CmdBufferDepth))
+            from = X_CONFIG;
+        if (pdrv->CmdBufferDepth < 1)
+            pdrv->CmdBufferDepth = 1;
+        xf86DrvMsg(pScrn->scrnIndex, from, "Allowing %d command%s in flight to the engine\n",
+                pdrv->CmdBufferDepth, (pdrv->CmdBufferDepth == 1) ? "" : "s");
+
+        from = X_DEFAULT;
+        pdrv->PackedMMIO = TRUE;
+        if (xf86GetOptValBool(pdrv->Options, OPTION_PACKED_MMIO, &pdrv->PackedMMIO))
+            from = X_CONFIG;
+        xf86DrvMsg(pScrn->scrnIndex, from, "Using %s writes for engine register pairs\n",
+                pdrv->PackedMMIO ? "32-bit" : "16-bit");
     }
 
     from = X_DEFAULT;
@@ -776,6 +798,10 @@ static Bool SpitfirePreInit(ScrnInfoPtr pScrn, int flags)
     if (pdrv->DumpRegs)
         xf86DrvMsg(pScrn->scrnIndex, from, "Dumping video card registers at key operations\n");
 
+    pdrv->DumpWaitStats = FALSE;
+    if (xf86GetOptValBool(pdrv->Options, OPTION_DUMP_WAIT_STATS, &pdrv->DumpWaitStats))
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "Dumping engine wait times on VT switch and exit\n");
+
     if (pScrn->numEntities > 1) {
         SpitfireFreeRec(pScrn);
         return FALSE;
@@ -1260,6 +1286,9 @@ static Bool SpitfireModeInit(ScrnInfoPtr pScrn, DisplayModePtr mode)
     
     pScrn->vtSema = TRUE;
 
+    /* Mode switch may clobber engine registers. This also covers EnterVT. */
+    SpitfireResetEngineState(pScrn);
+
     /* do it! */
     SpitfireWriteMode(pScrn, vganew, new, TRUE);
     SpitfireAdjustFrame(ADJUST_FRAME_ARGS(pScrn, pScrn->frameX0, pScrn->frameY0));
@@ -1712,12 +1741,48 @@ static Bool SpitfireCloseScreen(CLOSE_SCREEN_ARGS_DECL)
     SpitfirePtr pdrv = DEVPTR(pScrn);
     vgaRegPtr vgaSavePtr = &hwp->SavedReg;
     SpitfireRegPtr SpitfireSavePtr = &pdrv->SavedReg;
+    int i;
 
     TRACE(("SpitfireCloseScreen\n"));
 
+    if (!pdrv->NoAccel && pdrv->DumpWaitStats)
+        SpitfireDumpWaitStats(pScrn);
+
     if (pdrv->EXADriverPtr) {
+        if (pdrv->CreateGC) {
+            pScreen->CreateGC = pdrv->CreateGC;
+            pdrv->CreateGC = NULL;
+        }
+        if (pdrv->UnrealizeFont) {
+            pScreen->UnrealizeFont = pdrv->UnrealizeFont;
+            pdrv->UnrealizeFont = NULL;
+        }
+        if (pdrv->DestroyPixmap) {
+            pScreen->DestroyPixmap = pdrv->DestroyPixmap;
+            pdrv->DestroyPixmap = NULL;
+        }
+#ifdef SPITFIRE_MASKED_COPY
+        if (pdrv->Composite) {
+            GetPictureScreen(pScreen)->Composite = pdrv->Composite;
+            pdrv->Composite = NULL;
+        }
+#endif
         exaDriverFini(pScreen);
         pdrv->EXADriverPtr = NULL;
+        pdrv->StagingArea = NULL;
+        pdrv->GlyphArea = NULL;
+        pdrv->PatternArea = NULL;
+        pdrv->SeedArea = NULL;
+#ifdef SPITFIRE_MASKED_COPY
+        pdrv->MaskArea = NULL;
+#endif
+        free(pdrv->GlyphCache);
+        pdrv->GlyphCache = NULL;
+        for (i = 0; i < SPITFIRE_STIPPLE_CACHE_SIZE; i++) {
+            pdrv->StippleCache[i].area = NULL;
+            free(pdrv->StippleCache[i].bits);
+            pdrv->StippleCache[i].bits = NULL;
+        }
     }
 
 #ifdef HAVE_XAA_H
@@ -1817,6 +1882,14 @@ static void SpitfireLeaveVT(VT_FUNC_ARGS_DECL)
 
     TRACE(("SpitfireLeaveVT(%d)\n", flags));
 
+    /* EXA no longer waits for the engine on every sync, so make sure it is 
+       done before the mode is restored. */
+    if (!pdrv->NoAccel) {
+        SpitfireAccelSync(pScrn);
+        if (pdrv->DumpWaitStats)
+            SpitfireDumpWaitStats(pScrn);
+    }
+
     SpitfireWriteMode(pScrn, vgaSavePtr, SpitfireSavePtr, FALSE);
     SpitfireDisableMMIO(pScrn);
 }
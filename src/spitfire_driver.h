@@ -73,6 +73,142 @@ typedef struct {
 	unsigned char EX30, EX31; /* Hicolor/Truecolor and DAC width */
 } SpitfireRegRec, *SpitfireRegPtr;
 
+/* Software mirror of the 2D engine registers, as last programmed by the
+   driver. Used to avoid rewriting values that the engine already holds. The
+   pixmap registers are banked through PIXMAP_SELECT, so one copy is kept for
+   each of the 4 pixmap indexes. */
+typedef struct {
+    unsigned int valid;     /* Which of the fields below are known */
+
+    unsigned char PixSelect;
+    struct {
+        CARD32 Base;
+        CARD16 Width, Height;
+        CARD8 Format;
+    } Pixmap[4];
+
+    CARD8 RopMix;
+    CARD32 CCColor, CCCond;
+    CARD32 PixelBitmask;
+    CARD32 FgColor, BgColor;
+    CARD16 MaskX, MaskY;    /* Origin of the mask map in the destination */
+} SpitfireEngineStateRec, *SpitfireEngineStatePtr;
+
+/* Per-screen values used by the acceleration hot paths, computed once when
+   acceleration is initialized instead of on every call */
+typedef struct {
+    CARD8 FbFormat;         /* Engine pixel format of the framebuffer */
+    CARD16 FbWidth;         /* Framebuffer width in engine pixels, minus 1 */
+    int FbLines;            /* Lines of video memory, more than the engine
+                               reaches at once on some cards */
+    int XScale;             /* EXA: 3 if the current destination is 24bpp */
+    Bool Wide;              /* 24bpp programmed at 16bpp, see SpitfireWideBlit */
+    Bool Tall;              /* EXA: a pixmap of the current operation is taller
+                               than the engine reaches at once */
+    int SrcBand, DstBand;   /* ... and the first lines it was programmed from */
+    int ExpandX, ExpandY;   /* XAA: next scanline of the color expansion */
+    int ExpandW;            /* ... its width */
+    int ExpandSkip;         /* ... and the bits to skip at its start */
+    Bool SeedFill;          /* 24bpp: the current solid fill uses the seed row */
+    CARD32 FillColor;       /* ... with this color */
+    Bool FillCopy;          /* ... with GXcopy, so it may double onto itself */
+    Bool FillCpu;           /* ... and may be done by the CPU when small */
+    Bool CompositeCopy;     /* EXA: the current composite is a copy, not a fill */
+    int MonoTile;           /* XAA 24bpp: tile of the current mono pattern fill */
+    Bool MonoCopy;          /* ... with GXcopy, so it may double onto itself */
+    Bool Clip;              /* XAA: hardware clipping is enabled */
+    int ClipX1, ClipY1;     /* ... to this rectangle, inclusive */
+    int ClipX2, ClipY2;
+    int CpuRop;             /* XAA: the current operation, as drawn by the CPU
+                               once the engine has been given up on. X raster
+                               op... */
+    CARD32 CpuPlanemask;    /* ... planemask */
+    CARD32 CpuFg;           /* ... foreground color */
+    int CpuBg;              /* ... background color, -1 if transparent */
+    int CpuTrans;           /* ... color not copied, -1 if none */
+    int CpuXDir, CpuYDir;   /* ... directions of a copy */
+    int CpuPatX, CpuPatY;   /* ... color pattern in the pixmap cache */
+    CARD8 CpuMono[8];       /* ... rows of a mono pattern, LSB first */
+} SpitfireAccelContextRec, *SpitfireAccelContextPtr;
+
+/* Offscreen buffers that XAA writes 1bpp scanlines into, for the engine to
+   color expand. They are laid out as the rows of a single 1bpp pixmap. */
+#define SPITFIRE_SCANLINE_BUFFERS   4
+#define SPITFIRE_SCANLINE_PITCH     512     /* Bytes, 4096 pixels at 1bpp */
+
+/* Scratch row of packed RGB that 24bpp full color fills are copied from. At
+   most the widest 8bpp blit, in whole pixels. */
+#define SPITFIRE_SEED_BYTES         4095
+
+/* RENDER copies through an a1 mask, whose bits are shifted into place
+   assuming the bit order of the engine */
+#if defined(RENDER) && BITMAP_BIT_ORDER == LSBFirst
+#define SPITFIRE_MASKED_COPY
+#endif
+
+/* Strips of a1 masks uploaded for masked copies, two of these in the area */
+#define SPITFIRE_MASK_PITCH         512     /* Bytes, 4096 pixels at 1bpp */
+#define SPITFIRE_MASK_LINES         32
+
+/* Past line 4095, the engine is given pixmaps rebased onto bands of lines
+   starting at multiples of this, and operations in strips at most as tall */
+#define SPITFIRE_BAND_LINES         2048
+
+/* Histogram of the time spent waiting for the engine to go idle, for one
+   kind of command. Bucket 0 counts waits that found the engine already idle,
+   bucket n > 0 those that took less than 2^(n-1) microseconds, the last one
+   everything longer. */
+#define SPITFIRE_WAIT_TYPES         5
+#define SPITFIRE_WAIT_BUCKETS       24
+
+typedef struct {
+    CARD32 Count[SPITFIRE_WAIT_BUCKETS];
+    CARD64 TotalUsec;
+} SpitfireWaitHistRec, *SpitfireWaitHistPtr;
+
+/* One rectangle of an EXA solid fill or copy, queued between Prepare and Done.
+   Coordinates are already in engine units, i.e. tripled for 24bpp. */
+#define SPITFIRE_RECT_QUEUE_SIZE    64
+
+typedef struct {
+    CARD16 srcX, srcY;
+    CARD16 dstX, dstY;
+    CARD16 w, h;
+} SpitfireRectRec, *SpitfireRectPtr;
+
+/* Stipples expanded into offscreen memory for EXA stippled fills */
+#define SPITFIRE_STIPPLE_CACHE_SIZE 4
+
+typedef struct {
+    ExaOffscreenArea *area;     /* NULL while the entry holds nothing */
+    unsigned char *bits;        /* Copy of the stipple it was made from */
+    int width, height, stride;  /* ... and its size */
+    int repWidth, repHeight;    /* Size of the replicated copy */
+    int pitch;                  /* Bytes per line of the replicated copy */
+    CARD32 seq;                 /* Last submission that read it */
+    CARD32 lastUse;
+} SpitfireStippleRec, *SpitfireStipplePtr;
+
+/* Mono 8x8 patterns expanded into color tiles, for XAA at 24bpp. A tile has
+   the pattern repeated across and down twice, so that any 8 of its lines are
+   contiguous. Transparent patterns have a mask tile above the color one. */
+#define SPITFIRE_MONO_TILES         4
+#define SPITFIRE_MONO_TILE_PITCH    1536    /* Bytes, 64 repeats of 8 pixels */
+#define SPITFIRE_MONO_TILE_LINES    16      /* Per tile, twice that per entry */
+
+typedef struct {
+    CARD32 pat0, pat1;          /* Pattern bits, as XAA passes them */
+    int fg, bg;                 /* ... and colors, bg is -1 if transparent */
+    Bool valid;
+    CARD32 seq;                 /* Last submission that read it */
+    CARD32 lastUse;
+} SpitfireMonoTileRec, *SpitfireMonoTilePtr;
+
+/* Copy of a rectangle of wBytes by h between system memory and framebuffer */
+typedef void (*SpitfireCopyRectProc)(unsigned char *dst, int dstPitch,
+                                     const unsigned char *src, int srcPitch,
+                                     int wBytes, int h);
+
 #include "compat-api.h"
 
 #define SPITFIRE_INDEX 0x3de
@@ -171,9 +307,16 @@ typedef struct _Spitfire {
     Bool			UseBIOS;
     Bool			InitBIOS;
     Bool			DumpRegs;
+    Bool			DumpWaitStats;
     int				rotate;
 
     CloseScreenProcPtr	CloseScreen;
+    CreateGCProcPtr	CreateGC;	/* Wrapped for EXA line and text drawing */
+    UnrealizeFontProcPtr	UnrealizeFont;	/* Wrapped to drop cached glyphs */
+    DestroyPixmapProcPtr	DestroyPixmap;	/* Wrapped to track freed video memory */
+#ifdef SPITFIRE_MASKED_COPY
+    CompositeProcPtr	Composite;	/* Wrapped for a1 masked copies */
+#endif
 
 #ifdef XSERVER_LIBPCIACCESS
     struct pci_device * PciInfo;
@@ -207,6 +350,51 @@ typedef struct _Spitfire {
     XAAInfoRecPtr	AccelInfoRec;
 #endif
     unsigned int	SavedAccelCmd;
+    SpitfireEngineStateRec	EngineState;
+    SpitfireAccelContextRec	Accel;
+    int			CmdBufferDepth;	/* Commands in flight before we must wait */
+    Bool		PackedMMIO;	/* Write 16-bit register pairs as one 32-bit write */
+    int			CmdPending;	/* Commands submitted since engine was last idle */
+    CARD32		SubmitSeq;	/* Number of the last command submitted */
+    CARD32		RetiredSeq;	/* Last command known to be finished */
+    CARD32		FreedSeq;	/* Last command that may use video memory
+					   EXA has since handed to someone else */
+    CARD32		LastCmd;	/* Command word last written to the engine */
+    int			EngineHangs;	/* Timeouts recovered from with TERMINATE_OP */
+    CARD32		HangSeq;	/* SubmitSeq when the last of them happened */
+    Bool		EngineFailed;	/* Engine given up on, drawing is left to the CPU */
+    int			ScrnIndex;	/* For messages from the engine helpers */
+    CARD64		PendingPixels;	/* Engine pixels submitted since it was last idle */
+    SpitfireWaitHistRec	WaitHist[SPITFIRE_WAIT_TYPES];
+    PixmapPtr		CopySrcPixmap;	/* Source of the EXA copy in progress */
+    SpitfireRectRec	RectQueue[SPITFIRE_RECT_QUEUE_SIZE];
+    int			RectCount;	/* Rectangles queued, not yet submitted */
+    SpitfireCopyRectProc	UploadCopy;	/* CPU copy used by UploadToScreen */
+    SpitfireCopyRectProc	DownloadCopy;	/* CPU copy used by DownloadFromScreen */
+    ExaOffscreenArea *	StagingArea;	/* Offscreen area used to pack readbacks */
+    unsigned char *	ScanlineBuffers[SPITFIRE_SCANLINE_BUFFERS];
+    CARD32		ScanlineOffset;	/* Video address of the first buffer */
+    CARD32		ScanlineSeq[SPITFIRE_SCANLINE_BUFFERS]; /* Last expansion reading each */
+    ExaOffscreenArea *	GlyphArea;	/* 1bpp glyph atlas for EXA text */
+    struct _SpitfireGlyphCache *GlyphCache;	/* What the atlas holds */
+    SpitfireStippleRec	StippleCache[SPITFIRE_STIPPLE_CACHE_SIZE];
+    ExaOffscreenArea *	PatternArea;	/* EXA: 8x8 tile packed for the engine */
+    CARD32		PatternOffset;	/* XAA: same, at the end of video memory */
+    ExaOffscreenArea *	SeedArea;	/* EXA: row for 24bpp full color fills */
+    int			SeedLine;	/* XAA: same, a line at the end of video memory */
+    int			SeedBytes;	/* Width of the row */
+    CARD32		SeedColor;	/* Color it holds, if SeedValid */
+    Bool		SeedValid;
+    CARD32		SeedSeq;	/* Last submission that read it */
+#ifdef SPITFIRE_MASKED_COPY
+    ExaOffscreenArea *	MaskArea;	/* EXA: strips of an a1 RENDER mask */
+    CARD32		MaskSeq[2];	/* Last blit reading each half of it */
+    int			MaskHalf;	/* Half filled last */
+#endif
+    CARD32		StippleUses;	/* Clock for picking the entry to replace */
+    CARD32		MonoTileOffset;	/* XAA: mono pattern tiles, at the end of video memory */
+    SpitfireMonoTileRec	MonoTiles[SPITFIRE_MONO_TILES];
+    CARD32		MonoTileUses;	/* Clock for picking the entry to replace */
 
     SpitfireModeTablePtr	ModeTable;
 
@@ -0,0 +1,245 @@
+/*
+   Rectangle copies between system memory and the framebuffer aperture.
+
+   The framebuffer is mapped write-combined, so it is fastest to fill it with
+   whole aligned lines of stores that bypass the cache. Reads from it are not
+   cached at all, so they should be as wide as possible, and use streaming 
+   loads where the CPU has them. The copy routines are picked once, at 
+   runtime, from what the CPU supports.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "spitfire_driver.h"
+#include "spitfire_accel.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) \
+    && (defined(__i386__) || defined(__x86_64__))
+#define SPITFIRE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* Rows narrower than this are not worth the alignment prologue */
+#define SPITFIRE_STREAM_MIN_BYTES   64
+
+static void
+SpitfireCopyRectGeneric(unsigned char *dst, int dstPitch,
+                        const unsigned char *src, int srcPitch,
+                        int wBytes, int h)
+{
+    while (h--) {
+        memcpy(dst, src, wBytes);
+        dst += dstPitch;
+        src += srcPitch;
+    }
+}
+
+#ifdef SPITFIRE_X86_SIMD
+__attribute__((target("sse2")))
+static void
+SpitfireCopyRectSSE2(unsigned char *dst, int dstPitch,
+                     const unsigned char *src, int srcPitch,
+                     int wBytes, int h)
+{
+    if (wBytes < SPITFIRE_STREAM_MIN_BYTES) {
+        SpitfireCopyRectGeneric(dst, dstPitch, src, srcPitch, wBytes, h);
+        return;
+    }
+
+    while (h--) {
+        unsigned char *d = dst;
+        const unsigned char *s = src;
+        int n = wBytes;
+        int head = (-(unsigned long)d) & 15;
+
+        /* Bring the destination to a 16 byte boundary */
+        memcpy(d, s, head);
+        d += head; s += head; n -= head;
+
+        for (; n >= 64; n -= 64, d += 64, s += 64) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(s +  0));
+            __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+            __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+            _mm_stream_si128((__m128i *)(d +  0), a);
+            _mm_stream_si128((__m128i *)(d + 16), b);
+            _mm_stream_si128((__m128i *)(d + 32), c);
+            _mm_stream_si128((__m128i *)(d + 48), e);
+        }
+        for (; n >= 16; n -= 16, d += 16, s += 16)
+            _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+        memcpy(d, s, n);
+
+        dst += dstPitch;
+        src += srcPitch;
+    }
+
+    /* Streaming stores are weakly ordered, drain them before anything else
+       (such as the engine) gets to look at the data. */
+    _mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void
+SpitfireCopyRectAVX2(unsigned char *dst, int dstPitch,
+                     const unsigned char *src, int srcPitch,
+                     int wBytes, int h)
+{
+    if (wBytes < SPITFIRE_STREAM_MIN_BYTES) {
+        SpitfireCopyRectGeneric(dst, dstPitch, src, srcPitch, wBytes, h);
+        return;
+    }
+
+    while (h--) {
+        unsigned char *d = dst;
+        const unsigned char *s = src;
+        int n = wBytes;
+        int head = (-(unsigned long)d) & 31;
+
+        /* Bring the destination to a 32 byte boundary */
+        memcpy(d, s, head);
+        d += head; s += head; n -= head;
+
+        for (; n >= 64; n -= 64, d += 64, s += 64) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(s +  0));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+            _mm256_stream_si256((__m256i *)(d +  0), a);
+            _mm256_stream_si256((__m256i *)(d + 32), b);
+        }
+        for (; n >= 32; n -= 32, d += 32, s += 32)
+            _mm256_stream_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+        memcpy(d, s, n);
+
+        dst += dstPitch;
+        src += srcPitch;
+    }
+
+    _mm_sfence();
+}
+
+/* Reads from the framebuffer. Only the source needs to be aligned here. */
+__attribute__((target("sse2")))
+static void
+SpitfireReadRectSSE2(unsigned char *dst, int dstPitch,
+                     const unsigned char *src, int srcPitch,
+                     int wBytes, int h)
+{
+    if (wBytes < SPITFIRE_STREAM_MIN_BYTES) {
+        SpitfireCopyRectGeneric(dst, dstPitch, src, srcPitch, wBytes, h);
+        return;
+    }
+
+    while (h--) {
+        unsigned char *d = dst;
+        const unsigned char *s = src;
+        int n = wBytes;
+        int head = (-(unsigned long)s) & 15;
+
+        memcpy(d, s, head);
+        d += head; s += head; n -= head;
+
+        for (; n >= 64; n -= 64, d += 64, s += 64) {
+            __m128i a = _mm_load_si128((const __m128i *)(s +  0));
+            __m128i b = _mm_load_si128((const __m128i *)(s + 16));
+            __m128i c = _mm_load_si128((const __m128i *)(s + 32));
+            __m128i e = _mm_load_si128((const __m128i *)(s + 48));
+            _mm_storeu_si128((__m128i *)(d +  0), a);
+            _mm_storeu_si128((__m128i *)(d + 16), b);
+            _mm_storeu_si128((__m128i *)(d + 32), c);
+            _mm_storeu_si128((__m128i *)(d + 48), e);
+        }
+        for (; n >= 16; n -= 16, d += 16, s += 16)
+            _mm_storeu_si128((__m128i *)d, _mm_load_si128((const __m128i *)s));
+        memcpy(d, s, n);
+
+        dst += dstPitch;
+        src += srcPitch;
+    }
+}
+
+/* MOVNTDQA fetches a whole line from write-combined memory at once, instead
+   of one bus read per load. */
+__attribute__((target("sse4.1")))
+static void
+SpitfireReadRectSSE41(unsigned char *dst, int dstPitch,
+                      const unsigned char *src, int srcPitch,
+                      int wBytes, int h)
+{
+    if (wBytes < SPITFIRE_STREAM_MIN_BYTES) {
+        SpitfireCopyRectGeneric(dst, dstPitch, src, srcPitch, wBytes, h);
+        return;
+    }
+
+    /* Order against earlier writes to the framebuffer */
+    _mm_mfence();
+
+    while (h--) {
+        unsigned char *d = dst;
+        const unsigned char *s = src;
+        int n = wBytes;
+        int head = (-(unsigned long)s) & 15;
+
+        memcpy(d, s, head);
+        d += head; s += head; n -= head;
+
+        for (; n >= 64; n -= 64, d += 64, s += 64) {
+            __m128i a = _mm_stream_load_si128((__m128i *)(s +  0));
+            __m128i b = _mm_stream_load_si128((__m128i *)(s + 16));
+            __m128i c = _mm_stream_load_si128((__m128i *)(s + 32));
+            __m128i e = _mm_stream_load_si128((__m128i *)(s + 48));
+            _mm_storeu_si128((__m128i *)(d +  0), a);
+            _mm_storeu_si128((__m128i *)(d + 16), b);
+            _mm_storeu_si128((__m128i *)(d + 32), c);
+            _mm_storeu_si128((__m128i *)(d + 48), e);
+        }
+        for (; n >= 16; n -= 16, d += 16, s += 16)
+            _mm_storeu_si128((__m128i *)d, _mm_stream_load_si128((__m128i *)s));
+        memcpy(d, s, n);
+
+        dst += dstPitch;
+        src += srcPitch;
+    }
+}
+#endif
+
+/* Choose the fastest rectangle copy into the framebuffer for this CPU */
+SpitfireCopyRectProc
+SpitfireSelectUploadCopy(const char **name)
+{
+#ifdef SPITFIRE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "AVX2";
+        return SpitfireCopyRectAVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "SSE2";
+        return SpitfireCopyRectSSE2;
+    }
+#endif
+    *name = "memcpy";
+    return SpitfireCopyRectGeneric;
+}
+
+/* Choose the fastest rectangle copy out of the framebuffer for this CPU */
+SpitfireCopyRectProc
+SpitfireSelectDownloadCopy(const char **name)
+{
+#ifdef SPITFIRE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        *name = "SSE4.1";
+        return SpitfireReadRectSSE41;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "SSE2";
+        return SpitfireReadRectSSE2;
+    }
+#endif
+    *name = "memcpy";
+    return SpitfireCopyRectGeneric;
+}